@@ -27,6 +27,12 @@
 #include "http/api_docs.hh"
 #include "http/http2_connection.hh"
 #include "http/http2_client.hh"
+#include "http/http1_client.hh"
+#include "core/fstream.hh"
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+#include <yaml-cpp/yaml.h>
 
 namespace bpo = boost::program_options;
 namespace h2 = seastar::httpd2;
@@ -35,6 +41,7 @@ using namespace seastar;
 using namespace httpd;
 
 static auto debug_handlers = false;
+static auto zero_copy_files = false;
 constexpr static auto hardcoded_path = "/home/yurai/seastar/http2_reload/test_http2/";
 
 class handl : public httpd::handler_base {
@@ -58,6 +65,10 @@ void set_routes(routes& r, h2::routes &rhttp2) {
         return make_ready_future<json::json_return_type>("json-future");
     });
     r.add(operation_type::GET, url("/"), h1);
+    // same body as the HTTP/2 /get, for --protocol=http1 comparisons
+    r.add(operation_type::GET, url("/get"), new function_handler([](const_req req) {
+        return "hello!";
+    }));
     r.add(operation_type::GET, url("/jf"), h2);
     r.add(operation_type::GET, url("/file").remainder("path"),
             new directory_handler("/"));
@@ -86,7 +97,15 @@ void set_routes(routes& r, h2::routes &rhttp2) {
         return make_ready_future<std::tuple<lw_shared_ptr<h2::request>, std::unique_ptr<h2::response>>>(
                                     std::make_tuple(std::move(req), std::move(rep)));
     })
-    .add_directory_handler(new seastar::httpd2::directory_handler(hardcoded_path))
+    .add(h2::method::POST, "/upload", [](auto req, auto rep){
+        if (debug_handlers) {
+            fmt::print("method: {}\npath: {}\nbody: {} bytes\n", req->_method, req->_path, req->_body.size());
+        }
+        rep->_body = format("received {} bytes\n", req->_body.size());
+        return make_ready_future<std::tuple<lw_shared_ptr<h2::request>, std::unique_ptr<h2::response>>>(
+                                    std::make_tuple(std::move(req), std::move(rep)));
+    })
+    .add_directory_handler(new seastar::httpd2::directory_handler(hardcoded_path, zero_copy_files))
     .add_on_push("/push",
     [](auto req, auto rep){
         rep->add_headers({{":method", "GET"}, {":scheme", "http"},
@@ -110,11 +129,17 @@ void set_routes(routes& r, h2::routes &rhttp2) {
     });
 }
 
+// the HTTP/1.1 client doesn't look at bodies
+void set_handler(h2::http1_client&) {
+}
+
 void set_handler(h2::http_client& client) {
-    client._routes.add_on_client([&](const auto rep){
-        client._responses++;
-        if (debug_handlers) {
-            fmt::print("recieved {}B: {}\n", rep.size(), rep);
+    client._routes.add_on_client([&](int32_t stream_id, temporary_buffer<char> chunk, bool end_of_stream){
+        if (end_of_stream) {
+            client._responses++;
+        }
+        if (debug_handlers && !chunk.empty()) {
+            fmt::print("recieved {}B on stream {}: {}\n", chunk.size(), stream_id, sstring(chunk.get(), chunk.size()));
         }
     });
 }
@@ -130,6 +155,14 @@ future<> server(bpo::variables_map config) {
         return server->set_routes([rb](routes& r){rb->set_api_doc(r);});
     }).then([server, rb]{
         return server->set_routes([rb](routes& r) {rb->register_function(r, "demo", "hello world application");});
+    }).then([server, preload = config["preload"].as<bool>()] {
+        if (!preload) {
+            return make_ready_future<>();
+        }
+        // every shard keeps its own replica of the bundle
+        return server->server().invoke_on_all([] (http_server& s) {
+            return s._routes_http2._directory_handler->preload().discard_result();
+        });
     }).then([server, port, with_tls] {
         return server->listen(port, with_tls);
     }).then([server, port] {
@@ -141,37 +174,363 @@ future<> server(bpo::variables_map config) {
     });
 }
 
-future<> http2_client(bpo::variables_map config) {
+static double us(uint64_t ns) {
+    return ns / 1000.0;
+}
+
+static void print_latencies(const char *name, const h2::latency_histogram &h) {
+    fmt::print("{} [us]: min {:.1f} p50 {:.1f} p90 {:.1f} p99 {:.1f} p99.9 {:.1f} max {:.1f}\n", name, us(h.min()),
+               us(h.percentile(0.5)), us(h.percentile(0.9)), us(h.percentile(0.99)), us(h.percentile(0.999)), us(h.max()));
+}
+
+// one "series highest_value_ns count" line per non-empty bucket
+static future<> dump_histograms(sstring path, std::vector<std::pair<sstring, h2::latency_histogram>> series) {
+    if (path.empty()) {
+        return make_ready_future<>();
+    }
+    auto text = make_lw_shared<sstring>();
+    for (auto &[name, h] : series) {
+        h.for_each_bucket([&text, &name = name] (uint64_t value, uint64_t count) {
+            *text += format("{} {} {}\n", name, value, count);
+        });
+    }
+    return open_file_dma(path, open_flags::wo | open_flags::create | open_flags::truncate).then([text] (file f) {
+        return do_with(make_file_output_stream(std::move(f)), [text] (output_stream<char> &out) {
+            return out.write(*text).then([&out] {
+                return out.close();
+            });
+        });
+    });
+}
+
+// HTTP/2 and legacy HTTP/1.1 listeners of the server
+template<typename Client>
+static ipv4_addr server_address() {
+    return {"127.0.0.1", std::is_same_v<Client, h2::http1_client>? uint16_t(10000) : uint16_t(3000)};
+}
+
+template<typename Client>
+static future<> start_client(distributed<Client> *client, const bpo::variables_map &config) {
+    if constexpr (std::is_same_v<Client, h2::http1_client>) {
+        return client->start(config["pipeline"].as<unsigned>());
+    } else {
+        return client->start();
+    }
+}
+
+/*
+ * --output json|csv: one record per shard and one for all of them, so
+ * results can be diffed across runs and shard imbalance stays visible.
+ */
+template<typename Client>
+static future<> report_shards(distributed<Client> *client, sstring output, steady_clock_type::time_point started) {
+    if (output == "text") {
+        return make_ready_future<>();
+    }
+    auto seconds = std::chrono::duration<double>(steady_clock_type::now() - started).count();
+    return client->map_reduce0(std::mem_fn(&Client::result), std::vector<h2::shard_result>(),
+            [] (auto shards, auto shard) {
+        shards.push_back(std::move(shard));
+        return shards;
+    }).then([output, seconds] (auto shards) {
+        fmt::print("{}", h2::format_shard_results(std::move(shards), seconds, output));
+    });
+}
+
+// print is false when the results go out as --output json|csv instead
+static future<> report_steps(std::vector<std::vector<h2::step_result>> shards, sstring histogram_file, bool print) {
+    std::vector<h2::step_result> steps = shards.empty()? std::vector<h2::step_result>() : shards[0];
+    for (auto shard = 1u; shard < shards.size(); shard++) {
+        for (auto step = 0u; step < steps.size(); step++) {
+            steps[step].rate += shards[shard][step].rate;
+            steps[step].sent += shards[shard][step].sent;
+            steps[step].errors += shards[shard][step].errors;
+            steps[step].latencies.merge(shards[shard][step].latencies);
+        }
+    }
+    if (print) {
+        fmt::print("{:>12} {:>10} {:>10} {:>10} {:>10} {:>10} {:>10} {:>10} {:>10} {:>10} {:>10}\n", "rate [req/s]", "sent", "completed",
+                   "errors", "ttfb p50", "ttfb p99", "p50 [us]", "p90 [us]", "p99 [us]", "p99.9 [us]", "max [us]");
+    }
+    std::vector<std::pair<sstring, h2::latency_histogram>> series;
+    for (auto step = 0u; step < steps.size(); step++) {
+        auto &ttfb = steps[step].latencies.ttfb;
+        auto &full = steps[step].latencies.full;
+        if (print) {
+            fmt::print("{:>12.0f} {:>10} {:>10} {:>10} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f}\n",
+                       steps[step].rate, steps[step].sent, full.count(), steps[step].errors, us(ttfb.percentile(0.5)), us(ttfb.percentile(0.99)),
+                       us(full.percentile(0.5)), us(full.percentile(0.9)), us(full.percentile(0.99)), us(full.percentile(0.999)),
+                       us(full.max()));
+        }
+        series.emplace_back(format("ttfb_step{}", step), ttfb);
+        series.emplace_back(format("full_step{}", step), full);
+    }
+    return dump_histograms(std::move(histogram_file), std::move(series));
+}
+
+// "250us", "10ms", "5s" or "1m", plain numbers are milliseconds
+static std::chrono::microseconds parse_duration(const std::string &text) {
+    size_t digits;
+    auto value = std::stoull(text, &digits);
+    auto unit = text.substr(digits);
+    if (unit == "us") {
+        return std::chrono::microseconds(value);
+    } else if (unit == "ms" || unit.empty()) {
+        return std::chrono::milliseconds(value);
+    } else if (unit == "s") {
+        return std::chrono::seconds(value);
+    } else if (unit == "m") {
+        return std::chrono::minutes(value);
+    }
+    throw std::runtime_error(format("invalid duration: {}", text));
+}
+
+namespace YAML {
+template<>
+struct convert<h2::request_template> {
+    static bool decode(const Node& node, h2::request_template& t) {
+        t.name = node["name"].as<std::string>();
+        if (node["weight"]) {
+            t.weight = node["weight"].as<unsigned>();
+        }
+        if (node["method"]) {
+            t.method = node["method"].as<std::string>();
+        }
+        if (node["path"]) {
+            t.path = node["path"].as<std::string>();
+        }
+        if (node["headers"]) {
+            for (auto &&h : node["headers"]) {
+                t.headers.emplace_back(h.first.as<std::string>(), h.second.as<std::string>());
+            }
+        }
+        if (node["body_size"]) {
+            t.body_size = node["body_size"].as<size_t>();
+        }
+        return t.weight > 0;
+    }
+};
+
+template<>
+struct convert<h2::workload> {
+    static bool decode(const Node& node, h2::workload& w) {
+        for (auto &&t : node["requests"]) {
+            w.requests.push_back(t.as<h2::request_template>());
+        }
+        if (node["connections"]) {
+            w.connections = node["connections"].as<unsigned>();
+        }
+        if (node["concurrency"]) {
+            w.concurrency = node["concurrency"].as<unsigned>();
+        }
+        if (node["think_time"]) {
+            w.think_time = parse_duration(node["think_time"].as<std::string>());
+        }
+        if (node["ramp_up"]) {
+            w.ramp_up = std::chrono::duration_cast<std::chrono::milliseconds>(parse_duration(node["ramp_up"].as<std::string>()));
+        }
+        if (node["duration"]) {
+            w.duration = std::chrono::duration_cast<std::chrono::milliseconds>(parse_duration(node["duration"].as<std::string>()));
+        }
+        return !w.requests.empty() && w.connections > 0 && w.concurrency > 0;
+    }
+};
+}
+
+static future<> report_workload(const h2::workload &w, std::vector<h2::template_result> results, sstring histogram_file, bool print) {
+    auto seconds = std::chrono::duration<double>(w.duration + w.ramp_up).count();
+    if (print) {
+        fmt::print("{:>16} {:>10} {:>10} {:>10} {:>10} {:>10} {:>10} {:>10} {:>10}\n", "request", "sent", "errors", "req/s",
+                   "ttfb p50", "ttfb p99", "p50 [us]", "p99 [us]", "max [us]");
+    }
+    std::vector<std::pair<sstring, h2::latency_histogram>> series;
+    for (auto i = 0u; i < results.size(); i++) {
+        auto &name = w.requests[i].name;
+        auto &ttfb = results[i].latencies.ttfb;
+        auto &full = results[i].latencies.full;
+        if (print) {
+            fmt::print("{:>16} {:>10} {:>10} {:>10.0f} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f}\n", name,
+                       results[i].sent, results[i].errors, full.count() / seconds, us(ttfb.percentile(0.5)),
+                       us(ttfb.percentile(0.99)), us(full.percentile(0.5)), us(full.percentile(0.99)), us(full.max()));
+        }
+        series.emplace_back(format("ttfb_{}", name), ttfb);
+        series.emplace_back(format("full_{}", name), full);
+    }
+    return dump_histograms(std::move(histogram_file), std::move(series));
+}
+
+/*
+ * Closed-loop mixed traffic described by a YAML file, e.g.
+ *
+ *   connections: 4
+ *   concurrency: 16
+ *   think_time: 1ms
+ *   ramp_up: 2s
+ *   duration: 30s
+ *   requests:
+ *     - name: get
+ *       weight: 9
+ *       path: /get
+ *     - name: upload
+ *       weight: 1
+ *       method: POST
+ *       path: /upload
+ *       headers: {content-type: application/octet-stream}
+ *       body_size: 65536
+ *
+ * connections and concurrency are per shard, TLS is not supported in this mode.
+ */
+template<typename Client>
+future<> run_client_workload(bpo::variables_map config) {
+    auto w = make_lw_shared<h2::workload>(YAML::LoadFile(config["workload"].as<std::string>()).as<h2::workload>());
+    const sstring histogram_file = config["histogram-file"].as<std::string>();
+    const sstring output = config["output"].as<std::string>();
+    auto client = new distributed<Client>;
+
+    const auto started = steady_clock_type::now();
+    return start_client(client, config)
+            .then([client, w](){
+                return client->invoke_on_all(&Client::run_workload, *w, server_address<Client>());
+            })
+            .then([client, output, started](){
+                return report_shards(client, output, started);
+            })
+            .then([client, w](){
+                return client->map_reduce0(std::mem_fn(&Client::workload_results),
+                        std::vector<h2::template_result>(w->requests.size()), [] (auto total, auto shard) {
+                    for (auto i = 0u; i < total.size(); i++) {
+                        total[i].merge(shard[i]);
+                    }
+                    return total;
+                });
+            })
+            .then([w, histogram_file, output](auto results){
+                return report_workload(*w, std::move(results), histogram_file, output == "text");
+            })
+            .then([client, w](){
+                return client->stop().then([client] {
+                    delete client;
+                    return make_ready_future<>();
+                });
+            });
+}
+
+template<typename Client>
+future<> run_client_at_rate(bpo::variables_map config) {
     const auto with_tls = config["tls"].as<bool>();
     const auto connections = config["con"].as<uint16_t>();
-    const auto reqs = config["req"].as<uint16_t>();
-    auto client = new distributed<h2::http_client>;
+    h2::rate_plan plan;
+    plan.rate = config["rate"].as<double>();
+    plan.rate_step = config["rate-step"].as<double>();
+    plan.steps = config["steps"].as<unsigned>();
+    plan.step_duration = std::chrono::milliseconds(config["step-duration"].as<unsigned>());
+    const sstring histogram_file = config["histogram-file"].as<std::string>();
+    const sstring output = config["output"].as<std::string>();
+    auto client = new distributed<Client>;
     auto req = new h2::request({ {":method", "GET"}, {":path", "/get"}, {":scheme", "https"},
-        {":authority", "127.0.0.1:3000"}, {"accept", "*/*"}, {"user-agent", "nghttp2/" NGHTTP2_VERSION} });
+        {":authority", format("{}", server_address<Client>())}, {"accept", "*/*"}, {"user-agent", "nghttp2/" NGHTTP2_VERSION} });
 
     const auto started = steady_clock_type::now();
-    return client->start()
+    return start_client(client, config)
             .then([client, with_tls, connections](){
-                ipv4_addr server_addr = {"127.0.0.1", 3000};
-                return client->invoke_on_all(&h2::http_client::connect, connections, server_addr, with_tls);
+                return client->invoke_on_all(&Client::connect, connections, server_address<Client>(), with_tls);
+            })
+            .then([output](){
+                if (output == "text") {
+                    fmt::print("established tcp connections\n");
+                }
+            })
+            .then([client](){
+                return client->invoke_on_all([](Client& client) {
+                    set_handler(client);
+                });
+            })
+            .then([client, req, plan](){
+                return client->invoke_on_all(&Client::run_at_rate, req, plan);
+            })
+            .then([client, output, started](){
+                return report_shards(client, output, started);
+            })
+            .then([client](){
+                return client->map_reduce0(std::mem_fn(&Client::step_results), std::vector<std::vector<h2::step_result>>(),
+                        [] (auto shards, auto steps) {
+                    shards.push_back(std::move(steps));
+                    return shards;
+                });
+            })
+            .then([histogram_file, output](auto shards){
+                return report_steps(std::move(shards), histogram_file, output == "text");
             })
             .then([client, req](){
-                return client->invoke_on_all([](h2::http_client& client) {
+                return client->stop().then([client, req] {
+                    delete req;
+                    delete client;
+                    return make_ready_future<>();
+                });
+            });
+}
+
+template<typename Client>
+future<> run_client(bpo::variables_map config) {
+    if (!config["workload"].as<std::string>().empty()) {
+        return run_client_workload<Client>(std::move(config));
+    }
+    if (config["rate"].as<double>() > 0) {
+        return run_client_at_rate<Client>(std::move(config));
+    }
+    const auto with_tls = config["tls"].as<bool>();
+    const auto connections = config["con"].as<uint16_t>();
+    const auto reqs = config["req"].as<uint16_t>();
+    const sstring histogram_file = config["histogram-file"].as<std::string>();
+    const sstring output = config["output"].as<std::string>();
+    auto client = new distributed<Client>;
+    auto req = new h2::request({ {":method", "GET"}, {":path", "/get"}, {":scheme", "https"},
+        {":authority", format("{}", server_address<Client>())}, {"accept", "*/*"}, {"user-agent", "nghttp2/" NGHTTP2_VERSION} });
+
+    const auto started = steady_clock_type::now();
+    return start_client(client, config)
+            .then([client, with_tls, connections](){
+                return client->invoke_on_all(&Client::connect, connections, server_address<Client>(), with_tls);
+            })
+            .then([client, req, output](){
+                if (output == "text") {
+                    fmt::print("established tcp connections\n");
+                }
+                return client->invoke_on_all([](Client& client) {
                     set_handler(client);
                 });
             })
             .then([client, req, reqs](){
-                return client->invoke_on_all(&h2::http_client::run, req, reqs);
+                return client->invoke_on_all(&Client::run, req, reqs);
+            })
+            .then([client, output, started](){
+                return report_shards(client, output, started);
             })
             .then([client](){
-                return client->map_reduce(adder<uint64_t>(), &h2::http_client::responses);
+                return client->map_reduce(adder<uint64_t>(), &Client::responses);
             })
-            .then([client, req, started](auto total_responses){
+            .then([client, started, output](auto total_responses){
                 const auto finished = steady_clock_type::now();
                 const auto responses = static_cast<double>(total_responses);
                 auto elapsed = finished - started;
                 auto secs = static_cast<double>(elapsed.count() / 1000000000.0);
-                fmt::print("Total responses: {}\nReq/s: {}\nAvg resp time: {} us\n", total_responses, responses / secs, (secs / responses) * 1000000.0);
+                if (output == "text") {
+                    fmt::print("Total responses: {}\nReq/s: {}\nAvg resp time: {} us\n", total_responses, responses / secs, (secs / responses) * 1000000.0);
+                }
+                return client->map_reduce0(std::mem_fn(&Client::latencies), h2::client_latencies(),
+                        [] (auto total, auto shard) {
+                    total.merge(shard);
+                    return total;
+                });
+            })
+            .then([histogram_file, output](auto latencies){
+                if (output == "text") {
+                    print_latencies("TTFB", latencies.ttfb);
+                    print_latencies("Response", latencies.full);
+                }
+                return dump_histograms(histogram_file, {{"ttfb", latencies.ttfb}, {"full", latencies.full}});
+            })
+            .then([client, req](){
                 return client->stop().then([client, req] {
                     delete req;
                     delete client;
@@ -180,6 +539,13 @@ future<> http2_client(bpo::variables_map config) {
             });
 }
 
+future<> client(bpo::variables_map config) {
+    if (config["protocol"].as<std::string>() == "http1") {
+        return run_client<h2::http1_client>(std::move(config));
+    }
+    return run_client<h2::http_client>(std::move(config));
+}
+
 int main(int ac, char** av) {
     app_template app;
     app.add_options()("node,n", bpo::value<std::string>()->default_value("server"), "Node");
@@ -187,16 +553,40 @@ int main(int ac, char** av) {
     app.add_options()("tls,t", bpo::value<bool>()->default_value(false), "TLS enabled");
     app.add_options()("con", bpo::value<uint16_t>()->default_value(500u), "Connections number");
     app.add_options()("req,r", bpo::value<uint16_t>()->default_value(4000u), "Requests number per client connection");
+    app.add_options()("rate", bpo::value<double>()->default_value(0), "Open-loop request rate per shard [req/s], 0 sends --req requests per connection at once");
+    app.add_options()("rate-step", bpo::value<double>()->default_value(0), "Open-loop rate increase per step [req/s]");
+    app.add_options()("steps", bpo::value<unsigned>()->default_value(1u), "Open-loop rate steps");
+    app.add_options()("step-duration", bpo::value<unsigned>()->default_value(10000u), "Open-loop step duration [ms]");
+    app.add_options()("protocol", bpo::value<std::string>()->default_value("http2"), "Client protocol: http2, or http1 against the legacy server");
+    app.add_options()("pipeline", bpo::value<unsigned>()->default_value(1u), "HTTP/1.1 requests in flight per connection");
+    app.add_options()("workload", bpo::value<std::string>()->default_value(""), "Replay the mixed traffic described by this YAML file");
+    app.add_options()("output", bpo::value<std::string>()->default_value("text"), "Client results format: text, json or csv, json and csv break them down per shard");
+    app.add_options()("histogram-file", bpo::value<std::string>()->default_value(""), "Dump the client latency histograms to this file");
     app.add_options()("debug,d", bpo::value<bool>()->default_value(false), "Debugging info from handlers");
+    app.add_options()("zero-copy", bpo::value<bool>()->default_value(false), "Send HTTP/2 file DATA frames without copying");
+    app.add_options()("preload", bpo::value<bool>()->default_value(false), "Serve HTTP/2 static files from memory");
 
     return app.run_deprecated(ac, av, [&] {
         auto&& config = app.configuration();
         auto&& node = config["node"].as<std::string>();
         debug_handlers = config["debug"].as<bool>();
+        zero_copy_files = config["zero-copy"].as<bool>();
+        auto&& output = config["output"].as<std::string>();
+        if (output != "text" && output != "json" && output != "csv") {
+            fmt::print(std::cerr, "unknown --output format: {}\n", output);
+            engine().exit(1);
+            return make_ready_future<>();
+        }
+        auto&& protocol = config["protocol"].as<std::string>();
+        if (protocol != "http1" && protocol != "http2") {
+            fmt::print(std::cerr, "unknown --protocol: {}\n", protocol);
+            engine().exit(1);
+            return make_ready_future<>();
+        }
         if (node == "server") {
             return server(config);
         } else {
-            return http2_client(config);
+            return client(config);
         }
     });
 }
@@ -243,9 +243,16 @@ modes = {
     },
 }
 
+http2_perf_tests = [
+    'tests/perf/perf_http2_connection',
+    'tests/perf/perf_http2_hot_path',
+    'tests/perf/perf_http2_file_data',
+    'tests/perf/perf_http2',
+]
+
 perf_tests = [
     'tests/perf/perf_future_util',
-]
+] + http2_perf_tests
 
 tests = [
     'tests/file_io_test',
@@ -495,6 +502,10 @@ http = ['http/transformers.cc',
         'http/request_parser.rl',
         'http/api_docs.cc',
         'http/http2_request_response.cc',
+        'http/http2_compression.cc',
+        'http/http2_static_bundle.cc',
+        'http/http2_response_cache.cc',
+        'http/http2_upstream.cc',
         'http/http2_connection.cc'
         ]
 
@@ -552,7 +563,7 @@ deps = {
     'libseastar.a' : core + libnet + http + protobuf + prometheus,
     'seastar.pc': [],
     'fmt/fmt/libfmt.a': [],
-    'apps/httpd/httpd': ['apps/httpd/demo.json', 'apps/httpd/main.cc'] + http + libnet + core,
+    'apps/httpd/httpd': ['apps/httpd/demo.json', 'apps/httpd/main.cc', 'http/http_response_parser.rl'] + http + libnet + core,
     'apps/memcached/memcached': ['apps/memcached/memcache.cc'] + memcache_base,
     'tests/memcached/memcached_ascii_parser_test': ['tests/memcached/test_ascii_parser.cc'] + memcache_base,
     'tests/file_io_test': ['tests/fileiotest.cc'] + core,
@@ -646,6 +657,9 @@ for bt in boost_tests:
 for pt in perf_tests:
     deps[pt] = [pt + '.cc'] + core + ['tests/perf/perf_tests.cc']
 
+for pt in http2_perf_tests:
+    deps[pt] += http + libnet
+
 warnings = [
     '-Wno-mismatched-tags',                 # clang-only
     '-Wno-pessimizing-move',                # clang-only: moving a temporary object prevents copy elision
@@ -879,7 +893,7 @@ for mode in build_modes:
     configure_fmt(mode, cxx=args.cxx, cc=args.cc)
 
 libs += ' -lfmt'
-libs += ' -lnghttp2 -lssl'
+libs += ' -lnghttp2 -lssl -lz'
 
 fmt_deps = []
 for dirpath, dirnames, filenames in os.walk('fmt'):
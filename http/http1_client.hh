@@ -0,0 +1,443 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2018 ScyllaDB Ltd.
+ */
+
+#pragma once
+
+#include "core/reactor.hh"
+#include "core/semaphore.hh"
+#include "core/iostream.hh"
+#include "core/future-util.hh"
+#include "core/sleep.hh"
+#include "http/http_response_parser.hh"
+#include "http/http2_client.hh"
+#include <boost/range/irange.hpp>
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <stdexcept>
+#include <strings.h>
+#include <vector>
+
+namespace seastar {
+namespace httpd2 {
+
+// request line and headers of an HTTP/1.1 request equivalent to req, :authority becomes host
+inline sstring to_http1(const request &req) {
+    sstring head, headers;
+    for (auto &[name, value] : req.headers()) {
+        if (name == ":method") {
+            head = value + " " + head;
+        } else if (name == ":path") {
+            head += value;
+        } else if (name == ":authority") {
+            headers += "Host: " + value + "\r\n";
+        } else if (name[0] != ':') {
+            headers += name + ": " + value + "\r\n";
+        }
+    }
+    return head + " HTTP/1.1\r\n" + headers + "\r\n" + req._body;
+}
+
+/*
+ * Keep-alive HTTP/1.1 connection with up to depth requests pipelined. Requests
+ * are written as soon as a slot is free, responses are matched to them in
+ * order. Responses need a content-length, which the legacy server always sends.
+ */
+class http1_connection {
+    using time_point = steady_clock_type::time_point;
+public:
+    struct response_head {
+        // when the headers were parsed
+        time_point headers_at;
+        unsigned status;
+    };
+private:
+
+    // counts what the socket delivers before the parser sees it
+    class counting_source final : public data_source_impl {
+        input_stream<char> _in;
+        uint64_t &_bytes;
+    public:
+        counting_source(input_stream<char> in, uint64_t &bytes)
+            : _in(std::move(in)), _bytes(bytes) {}
+
+        future<temporary_buffer<char>> get() override {
+            return _in.read().then([this] (temporary_buffer<char> buf) {
+                _bytes += buf.size();
+                return buf;
+            });
+        }
+
+        future<> close() override {
+            return _in.close();
+        }
+    };
+
+    // http_response_parser keeps no status code, so the status line is
+    // picked up on its way to the parser
+    struct head_consumer {
+        http1_connection &conn;
+        using unconsumed_remainder = http_response_parser::unconsumed_remainder;
+
+        future<unconsumed_remainder> operator()(temporary_buffer<char> buf) {
+            auto &line = conn._status_line;
+            if (line.size() < status_line_prefix) {
+                line += sstring(buf.get(), std::min(buf.size(), status_line_prefix - line.size()));
+            }
+            return conn._parser(std::move(buf));
+        }
+    };
+    // "HTTP/1.1 200"
+    static constexpr size_t status_line_prefix = 12;
+public:
+    http1_connection(connected_socket fd, unsigned depth)
+        : _fd(std::move(fd))
+        , _in(data_source(std::make_unique<counting_source>(_fd.input(), _stats.bytes_received)))
+        , _out(_fd.output())
+        , _depth(depth)
+        , _slots(depth) {
+        _reader = read_responses();
+    }
+    http1_connection(const http1_connection&) = delete;
+    http1_connection &operator=(const http1_connection&) = delete;
+
+    // resolves once the whole response was read; text has to stay alive until then
+    future<response_head> send(const sstring &text) {
+        return _slots.wait().then([this, &text] {
+            _pending.emplace_back();
+            auto response = _pending.back().get_future();
+            _stats.bytes_sent += text.size();
+            // the write lock hands out turns in order, so requests go out in _pending order
+            with_semaphore(_write_lock, 1, [this, &text] {
+                return _out.write(text).then([this] {
+                    // a queued writer flushes for both
+                    return _write_lock.waiters()? make_ready_future<>() : _out.flush();
+                });
+            }).handle_exception([this] (std::exception_ptr e) {
+                fail(e);
+            });
+            return response;
+        });
+    }
+
+    // waits for the responses in flight, then closes the connection
+    future<> close() {
+        return _slots.wait(_depth).then_wrapped([this] (future<> f) {
+            f.ignore_ready_future();
+            return with_semaphore(_write_lock, 1, [this] {
+                return _out.close();
+            });
+        }).handle_exception([] (std::exception_ptr) {
+        }).then([this] {
+            // the server closes its side once it sees ours
+            return std::move(_reader);
+        }).then([this] {
+            return _in.close();
+        });
+    }
+
+    const connection_stats &stats() const {
+        return _stats;
+    }
+private:
+    unsigned status() const {
+        auto status = 0u;
+        for (auto i = status_line_prefix - 3; i < std::min(_status_line.size(), status_line_prefix); i++) {
+            if (_status_line[i] < '0' || _status_line[i] > '9') {
+                return 0;
+            }
+            status = status * 10 + (_status_line[i] - '0');
+        }
+        return status;
+    }
+
+    static size_t content_length(const http_response &rsp) {
+        for (auto &[name, value] : rsp._headers) {
+            if (!strcasecmp(name.c_str(), "content-length")) {
+                return std::stoul(value);
+            }
+        }
+        return 0;
+    }
+
+    future<> read_responses() {
+        return repeat([this] {
+            _parser.init();
+            _status_line = "";
+            return _in.consume(_head).then([this] {
+                if (_parser.eof()) {
+                    if (!_pending.empty()) {
+                        throw std::runtime_error("connection closed by the server");
+                    }
+                    return make_ready_future<stop_iteration>(stop_iteration::yes);
+                }
+                if (_pending.empty()) {
+                    throw std::runtime_error("unsolicited response");
+                }
+                response_head head{steady_clock_type::now(), status()};
+                auto length = content_length(*_parser.get_parsed_response());
+                return _in.skip(length).then([this, head] {
+                    auto done = std::move(_pending.front());
+                    _pending.pop_front();
+                    done.set_value(head);
+                    _slots.signal();
+                    return stop_iteration::no;
+                });
+            });
+        }).handle_exception([this] (std::exception_ptr e) {
+            fail(e);
+        });
+    }
+
+    void fail(std::exception_ptr e) {
+        for (auto &p : _pending) {
+            p.set_exception(e);
+        }
+        _pending.clear();
+        _slots.broken(e);
+    }
+
+    connection_stats _stats;
+    connected_socket _fd;
+    input_stream<char> _in;
+    output_stream<char> _out;
+    http_response_parser _parser;
+    sstring _status_line;
+    head_consumer _head {*this};
+    unsigned _depth;
+    semaphore _slots;
+    semaphore _write_lock {1};
+    std::deque<promise<response_head>> _pending;
+    future<> _reader = make_ready_future<>();
+};
+
+/*
+ * HTTP/1.1 counterpart of http_client, driving the legacy server with the
+ * same modes, timing and results so both listeners can be compared under
+ * identical load. Where HTTP/2 multiplexes streams, requests are pipelined:
+ * depth requests per connection in burst and open-loop mode, the workload's
+ * concurrency in workload mode. As with HTTP/2, workload responses with a
+ * status of 400 and above count as errors.
+ */
+class http1_client {
+    using time_point = steady_clock_type::time_point;
+public:
+    // depth is the number of requests pipelined per connection in burst and open-loop mode
+    explicit http1_client(unsigned depth = 1u)
+        : _depth(depth) {}
+
+    future<> connect(const uint16_t connections, ipv4_addr server_addr, bool with_tls) {
+        if (with_tls) {
+            return make_exception_future<>(std::invalid_argument("HTTP/1.1 client runs over plain TCP only"));
+        }
+        return parallel_for_each(boost::irange<uint16_t>(0, connections), [this, server_addr] (uint16_t) {
+            return engine().net().connect(make_ipv4_address(server_addr)).then([this] (connected_socket fd) {
+                _sockets.push_back(std::move(fd));
+            });
+        });
+    }
+
+    future<> run(request *req, const uint16_t reqs) {
+        _text = to_http1(*req);
+        open(_depth);
+        // all requests of the burst are queued now, as with HTTP/2
+        auto submitted = steady_clock_type::now();
+        return parallel_for_each(_connections, [this, reqs, submitted] (auto &conn) {
+            _sent += reqs;
+            return parallel_for_each(boost::irange<uint16_t>(0, reqs), [this, &conn, submitted] (uint16_t) {
+                return conn->send(_text).then([this, submitted] (http1_connection::response_head head) {
+                    _latencies.ttfb.record(head.headers_at - submitted);
+                    _latencies.full.record(steady_clock_type::now() - submitted);
+                    ++_responses;
+                }).handle_exception([this] (std::exception_ptr) {
+                    ++_failed_requests;
+                });
+            });
+        }).then([this] {
+            return close();
+        });
+    }
+
+    // open-loop mode, latency counts from the time each request was due
+    future<> run_at_rate(request *req, rate_plan plan) {
+        _text = to_http1(*req);
+        open(_depth);
+        return do_with(0u, [this, plan] (unsigned &step) {
+            return do_until([&step, plan] { return step == plan.steps; }, [this, &step, plan] {
+                auto rate = plan.rate + step * plan.rate_step;
+                _steps.push_back(step_result{rate});
+                return run_step(step, rate, plan.step_duration).then([&step] {
+                    ++step;
+                });
+            });
+        }).then([this] {
+            return _in_flight.close();
+        }).then([this] {
+            return close();
+        });
+    }
+
+    // closed-loop mode, see http_client::run_workload()
+    future<> run_workload(workload w, ipv4_addr server_addr) {
+        _workload = std::move(w);
+        _workload_results.assign(_workload.requests.size(), template_result());
+        for (const auto &t : _workload.requests) {
+            if (t.body_size) {
+                // the legacy server doesn't read request bodies
+                throw std::invalid_argument(format("request {}: bodies are only sent over HTTP/2", t.name));
+            }
+            request req({{":method", t.method}, {":path", t.path}, {":authority", format("{}", server_addr)}});
+            for (auto &[name, value] : t.headers) {
+                req.add_header(name, value);
+            }
+            _templates.push_back(to_http1(req));
+            _choice.add(t.weight);
+        }
+        return connect(_workload.connections, server_addr, false).then([this] {
+            open(_workload.concurrency);
+            auto loops = _workload.connections * _workload.concurrency;
+            auto start = steady_clock_type::now();
+            auto end = start + _workload.ramp_up + _workload.duration;
+            return parallel_for_each(boost::irange(0u, loops), [this, loops, end] (unsigned i) {
+                auto &conn = *_connections[i % _connections.size()];
+                return sleep(_workload.ramp_up * i / loops).then([this, &conn, end] {
+                    return do_until([end] { return steady_clock_type::now() >= end; }, [this, &conn] {
+                        return send_one(conn).then([this] {
+                            return _workload.think_time.count()? sleep(_workload.think_time) : make_ready_future<>();
+                        });
+                    });
+                });
+            });
+        }).then([this] {
+            return close();
+        });
+    }
+
+    future<> stop() { return make_ready_future(); }
+    future<uint64_t> responses() { return make_ready_future<uint64_t>(_responses); }
+    client_latencies latencies() const { return _latencies; }
+    std::vector<step_result> step_results() const { return _steps; }
+    std::vector<template_result> workload_results() const { return _workload_results; }
+
+    shard_result result() const {
+        shard_result r;
+        r.shard = engine().cpu_id();
+        r.sent = _sent;
+        r.responses = _responses;
+        r.failed_requests = _failed_requests;
+        r.traffic = _traffic;
+        r.latencies = _latencies;
+        for (auto &step : _steps) {
+            r.latencies.merge(step.latencies);
+        }
+        for (auto &t : _workload_results) {
+            r.latencies.merge(t.latencies);
+        }
+        r.cpu_time = thread_cpu_time() - _cpu_time_at_start;
+        return r;
+    }
+private:
+    void open(unsigned depth) {
+        for (auto &&socket : _sockets) {
+            _connections.push_back(std::make_unique<http1_connection>(std::move(socket), depth));
+        }
+        _sockets.clear();
+    }
+
+    future<> close() {
+        return parallel_for_each(_connections, [this] (auto &conn) {
+            return conn->close().then([this, &conn] {
+                _traffic.merge(conn->stats());
+            });
+        });
+    }
+
+    future<> run_step(unsigned step, double rate, std::chrono::milliseconds duration) {
+        auto period = std::chrono::duration_cast<steady_clock_type::duration>(std::chrono::duration<double>(1.0 / rate));
+        auto end = steady_clock_type::now() + duration;
+        return do_with(steady_clock_type::now(), [this, step, period, end] (time_point &due) {
+            return do_until([&due, end] { return due >= end; }, [this, &due, step, period, end] {
+                auto now = steady_clock_type::now();
+                for (; due <= now && due < end; due += period) {
+                    send_due(due, step);
+                }
+                auto wait = due - steady_clock_type::now();
+                return wait.count() > 0? sleep(wait) : make_ready_future<>();
+            });
+        });
+    }
+
+    // requests past the pipeline depth wait for a slot, still timed from due
+    void send_due(time_point due, unsigned step) {
+        ++_steps[step].sent;
+        ++_sent;
+        _next_connection = (_next_connection + 1) % _connections.size();
+        auto &conn = *_connections[_next_connection];
+        with_gate(_in_flight, [this, &conn, due, step] {
+            return conn.send(_text).then([this, due, step] (http1_connection::response_head head) {
+                _steps[step].latencies.ttfb.record(head.headers_at - due);
+                _steps[step].latencies.full.record(steady_clock_type::now() - due);
+                ++_responses;
+            }).handle_exception([this, step] (std::exception_ptr) {
+                ++_steps[step].errors;
+                ++_failed_requests;
+            });
+        });
+    }
+
+    future<> send_one(http1_connection &conn) {
+        auto i = _choice.pick();
+        auto &result = _workload_results[i];
+        auto sent = steady_clock_type::now();
+        ++result.sent;
+        ++_sent;
+        return conn.send(_templates[i]).then([this, &result, sent] (http1_connection::response_head head) {
+            result.latencies.ttfb.record(head.headers_at - sent);
+            if (head.status >= 400) {
+                ++result.errors;
+            }
+            result.latencies.full.record(steady_clock_type::now() - sent);
+            ++_responses;
+        }).handle_exception([this, &result] (std::exception_ptr) {
+            ++result.errors;
+            ++_failed_requests;
+        });
+    }
+
+    unsigned _depth {1u};
+    std::vector<connected_socket> _sockets;
+    std::vector<std::unique_ptr<http1_connection>> _connections;
+    size_t _next_connection {0};
+    sstring _text;
+    gate _in_flight;
+    std::vector<step_result> _steps;
+    client_latencies _latencies;
+    workload _workload;
+    std::vector<sstring> _templates;
+    weighted_choice _choice;
+    std::vector<template_result> _workload_results;
+    uint64_t _sent {0}, _responses {0}, _failed_requests {0};
+    connection_stats _traffic;
+    std::chrono::nanoseconds _cpu_time_at_start {thread_cpu_time()};
+};
+
+}
+}
@@ -0,0 +1,201 @@
+﻿/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2018 ScyllaDB Ltd.
+ */
+
+#pragma once
+
+#include "core/reactor.hh"
+#include "core/timer.hh"
+#include "core/memory.hh"
+#include "core/sstring.hh"
+#include "core/metrics_registration.hh"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+namespace seastar {
+namespace httpd2 {
+
+using namespace std::chrono_literals;
+
+struct admission_config {
+    float min_free_memory_ratio = 0.05f;
+    std::chrono::microseconds max_queue_delay = 5ms;
+    std::chrono::milliseconds sample_period = 10ms;
+    unsigned sustained_samples = 50u;
+    uint32_t streams_limit = 100u;
+    uint32_t reduced_streams_limit = 10u;
+};
+
+/*
+ * Shard-wide overload detector for HTTP/2 connections.
+ *
+ * Every sample_period it checks free memory and how late its own timer fired,
+ * which approximates the reactor task queue delay. While either threshold is
+ * crossed new streams should be refused with RST_STREAM(REFUSED_STREAM), which
+ * clients may safely retry elsewhere. When the pressure lasts for
+ * sustained_samples periods the advertised SETTINGS_MAX_CONCURRENT_STREAMS
+ * drops to reduced_streams_limit until the shard recovers.
+ */
+class admission_controller {
+public:
+    using config = admission_config;
+
+    explicit admission_controller(const sstring& name, config cfg = config())
+        : _cfg(cfg) {
+        namespace sm = seastar::metrics;
+        std::vector<sm::label_instance> labels;
+        labels.push_back(sm::label_instance("service", name));
+        _metric_groups.add_group("httpd2", {
+            sm::make_derive("refused_streams", [this] { return _refused_streams; },
+                            sm::description("The total number of streams refused due to shard overload"), labels),
+            sm::make_gauge("overloaded", [this] { return _overloaded? 1 : 0; },
+                           sm::description("Whether new HTTP/2 streams are currently refused"), labels),
+            sm::make_gauge("queue_delay_us", [this] { return _queue_delay.count(); },
+                           sm::description("Smoothed reactor queue delay observed by the admission controller"), labels),
+            sm::make_gauge("advertised_streams_limit", [this] { return streams_limit(); },
+                           sm::description("SETTINGS_MAX_CONCURRENT_STREAMS advertised to new and existing connections"), labels)
+        });
+        _last_sample = steady_clock_type::now();
+        _sampler.arm_periodic(_cfg.sample_period);
+    }
+
+    bool overloaded() const {
+        return _overloaded;
+    }
+
+    // called once per new stream, counts refusals for metrics
+    bool should_refuse() {
+        if (_overloaded) {
+            ++_refused_streams;
+        }
+        return _overloaded;
+    }
+
+    uint32_t streams_limit() const {
+        return _sustained? _cfg.reduced_streams_limit : _cfg.streams_limit;
+    }
+
+    uint64_t refused_streams() const {
+        return _refused_streams;
+    }
+private:
+    void sample() {
+        auto now = steady_clock_type::now();
+        auto lag = std::chrono::duration_cast<std::chrono::microseconds>(now - _last_sample - _cfg.sample_period);
+        _last_sample = now;
+        if (lag.count() < 0) {
+            lag = 0us;
+        }
+        // EWMA with alpha = 1/4, good enough to filter out a single late tick
+        _queue_delay = (_queue_delay * 3 + lag) / 4;
+
+        auto stats = memory::stats();
+        auto free_ratio = static_cast<float>(stats.free_memory()) / static_cast<float>(stats.total_memory());
+
+        _overloaded = free_ratio < _cfg.min_free_memory_ratio || _queue_delay > _cfg.max_queue_delay;
+        if (_overloaded) {
+            _calm_samples = 0;
+            if (++_hot_samples >= _cfg.sustained_samples) {
+                _sustained = true;
+            }
+        } else {
+            _hot_samples = 0;
+            if (++_calm_samples >= _cfg.sustained_samples) {
+                _sustained = false;
+            }
+        }
+    }
+
+    config _cfg;
+    bool _overloaded {false};
+    bool _sustained {false};
+    unsigned _hot_samples {0};
+    unsigned _calm_samples {0};
+    uint64_t _refused_streams {0};
+    std::chrono::microseconds _queue_delay {0};
+    steady_clock_type::time_point _last_sample;
+    timer<> _sampler { [this] { sample(); } };
+    metrics::metric_groups _metric_groups;
+};
+
+struct concurrency_limiter_config {
+    uint32_t min_limit = 4u;
+    uint32_t max_limit = 100u;
+    float tolerance = 2.0f;
+    // absolute slack on top of tolerance * min_rtt, scheduling jitter on a
+    // handler that completes in microseconds is not queueing
+    std::chrono::microseconds tolerance_floor = 1ms;
+    // EWMA weight of a new sample
+    float smoothing = 0.125f;
+    float backoff = 0.9f;
+    std::chrono::milliseconds decrease_interval = 100ms;
+    std::chrono::seconds min_rtt_window = 10s;
+};
+
+/*
+ * Per-connection concurrency limit driven by handler latency (AIMD).
+ *
+ * The lowest handler RTT seen in the current window is taken as the no-queueing
+ * baseline. When the smoothed RTT rises above tolerance * min_rtt plus
+ * tolerance_floor requests are queueing, so the limit is cut by backoff, at
+ * most once per decrease_interval. Otherwise, as long as the connection
+ * actually uses its limit, it grows by one stream per limit samples, i.e.
+ * roughly one per round trip like TCP congestion avoidance.
+ */
+class concurrency_limiter {
+public:
+    using config = concurrency_limiter_config;
+
+    explicit concurrency_limiter(config cfg = config())
+        : _cfg(cfg), _limit(cfg.max_limit) {}
+
+    void on_sample(std::chrono::microseconds rtt, unsigned inflight) {
+        auto now = steady_clock_type::now();
+        if (!_samples || rtt < _min_rtt || now - _min_rtt_since > _cfg.min_rtt_window) {
+            _min_rtt = rtt;
+            _min_rtt_since = now;
+        }
+        _smoothed_rtt = _samples++? _smoothed_rtt + _cfg.smoothing * (rtt.count() - _smoothed_rtt) : rtt.count();
+        if (_smoothed_rtt > _cfg.tolerance * _min_rtt.count() + _cfg.tolerance_floor.count()) {
+            if (now - _last_decrease > _cfg.decrease_interval) {
+                _limit = std::max<float>(_cfg.min_limit, _limit * _cfg.backoff);
+                _last_decrease = now;
+            }
+        } else if (inflight * 2 >= limit()) {
+            _limit = std::min<float>(_cfg.max_limit, _limit + 1.0f / _limit);
+        }
+    }
+
+    uint32_t limit() const {
+        return static_cast<uint32_t>(_limit);
+    }
+private:
+    config _cfg;
+    float _limit;
+    uint64_t _samples {0};
+    float _smoothed_rtt {0};
+    std::chrono::microseconds _min_rtt {0};
+    steady_clock_type::time_point _min_rtt_since;
+    steady_clock_type::time_point _last_decrease;
+};
+
+}
+}
@@ -29,15 +29,219 @@
 #include "core/distributed.hh"
 #include "core/queue.hh"
 #include "core/future-util.hh"
+#include "core/sleep.hh"
 #include <algorithm>
+#include <boost/range/irange.hpp>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <random>
+#include <time.h>
+#include <optional>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include "http/http2_connection.hh"
+#include "http/http2_histogram.hh"
+#include "http/http2_upstream.hh"
 #include "net/tls.hh"
 
 namespace seastar {
 namespace httpd2 {
 
+// open-loop schedule of one shard, the rate grows by rate_step every step
+struct rate_plan {
+    double rate {0};
+    double rate_step {0};
+    unsigned steps {1u};
+    std::chrono::milliseconds step_duration {10000};
+};
+
+// time to the first response HEADERS and to the end of the stream
+struct client_latencies {
+    latency_histogram ttfb;
+    latency_histogram full;
+
+    void merge(const client_latencies &other) {
+        ttfb.merge(other.ttfb);
+        full.merge(other.full);
+    }
+};
+
+struct step_result {
+    double rate {0};
+    uint64_t sent {0};
+    // reset or failed streams, they are left out of the latencies
+    uint64_t errors {0};
+    // measured from the time each request was due, not from when it went out
+    client_latencies latencies;
+};
+
+// one kind of request of a workload, picked with probability weight / total weight
+struct request_template {
+    sstring name;
+    unsigned weight {1u};
+    sstring method {"GET"};
+    sstring path {"/"};
+    std::vector<std::pair<sstring, sstring>> headers;
+    size_t body_size {0};
+};
+
+// closed-loop traffic mix, every connection keeps concurrency requests in flight
+struct workload {
+    std::vector<request_template> requests;
+    unsigned connections {1u};
+    unsigned concurrency {1u};
+    std::chrono::microseconds think_time {0};
+    // streams are started evenly over ramp_up, then run for duration
+    std::chrono::milliseconds ramp_up {0};
+    std::chrono::milliseconds duration {10000};
+};
+
+// draws template indexes with probability weight / total weight
+class weighted_choice {
+public:
+    void add(unsigned weight) {
+        _total += weight;
+        _cumulative.push_back(_total);
+    }
+
+    size_t pick() {
+        auto x = std::uniform_int_distribution<uint64_t>(0, _total - 1)(_random);
+        return std::upper_bound(_cumulative.begin(), _cumulative.end(), x) - _cumulative.begin();
+    }
+private:
+    std::vector<uint64_t> _cumulative;
+    uint64_t _total {0};
+    std::default_random_engine _random {std::random_device()()};
+};
+
+struct template_result {
+    uint64_t sent {0};
+    // failed requests and responses with status >= 400
+    uint64_t errors {0};
+    client_latencies latencies;
+
+    void merge(const template_result &other) {
+        sent += other.sent;
+        errors += other.errors;
+        latencies.merge(other.latencies);
+    }
+};
+
+// every shard is a thread, so this is the CPU time of the calling shard
+inline std::chrono::nanoseconds thread_cpu_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+}
+
+// what one shard of the client did, errors are counted by where they were seen
+struct shard_result {
+    unsigned shard {0};
+    uint64_t sent {0};
+    uint64_t responses {0};
+    uint64_t failed_requests {0};
+    connection_stats traffic;
+    client_latencies latencies;
+    std::chrono::nanoseconds cpu_time {0};
+};
+
+// one row of the per shard report, as name and value pairs in column order
+inline std::vector<std::pair<sstring, sstring>> shard_result_fields(const sstring &shard, const shard_result &r, double seconds) {
+    auto us = [] (uint64_t ns) {
+        return format("{:.1f}", ns / 1000.0);
+    };
+    auto per_request = [&r] (uint64_t value) {
+        return format("{:.1f}", r.responses? static_cast<double>(value) / r.responses : 0.0);
+    };
+    auto &full = r.latencies.full;
+    auto &ttfb = r.latencies.ttfb;
+    return {
+        {"shard", shard},
+        {"sent", to_sstring(r.sent)},
+        {"responses", to_sstring(r.responses)},
+        {"req_per_s", format("{:.1f}", r.responses / seconds)},
+        {"ttfb_p50_us", us(ttfb.percentile(0.5))},
+        {"ttfb_p99_us", us(ttfb.percentile(0.99))},
+        {"p50_us", us(full.percentile(0.5))},
+        {"p90_us", us(full.percentile(0.9))},
+        {"p99_us", us(full.percentile(0.99))},
+        {"p999_us", us(full.percentile(0.999))},
+        {"max_us", us(full.max())},
+        {"bytes_sent_per_req", per_request(r.traffic.bytes_sent)},
+        {"bytes_received_per_req", per_request(r.traffic.bytes_received)},
+        {"frames_sent_per_req", per_request(r.traffic.frames_sent)},
+        {"frames_received_per_req", per_request(r.traffic.frames_received)},
+        {"failed_requests", to_sstring(r.failed_requests)},
+        {"rst_received", to_sstring(r.traffic.resets_received)},
+        {"goaway_received", to_sstring(r.traffic.goaways_received)},
+        {"cpu_s", format("{:.3f}", std::chrono::duration<double>(r.cpu_time).count())},
+        {"cpu_us_per_req", format("{:.1f}", r.responses? r.cpu_time.count() / 1000.0 / r.responses : 0.0)},
+    };
+}
+
+// the shards ordered by id and their total, as "json" or "csv" text
+inline sstring format_shard_results(std::vector<shard_result> shards, double seconds, const sstring &output) {
+    std::sort(shards.begin(), shards.end(), [] (auto &a, auto &b) { return a.shard < b.shard; });
+    shard_result total;
+    std::vector<std::vector<std::pair<sstring, sstring>>> rows;
+    for (auto &r : shards) {
+        total.sent += r.sent;
+        total.responses += r.responses;
+        total.failed_requests += r.failed_requests;
+        total.traffic.merge(r.traffic);
+        total.latencies.merge(r.latencies);
+        total.cpu_time += r.cpu_time;
+        rows.push_back(shard_result_fields(to_sstring(r.shard), r, seconds));
+    }
+    rows.push_back(shard_result_fields("total", total, seconds));
+    sstring text;
+    if (output == "csv") {
+        sstring header;
+        for (auto &field : rows[0]) {
+            header += header.empty()? "" : ",";
+            header += field.first;
+        }
+        text += header + "\n";
+        for (auto &row : rows) {
+            sstring line;
+            for (auto &field : row) {
+                line += line.empty()? "" : ",";
+                line += field.second;
+            }
+            text += line + "\n";
+        }
+        return text;
+    }
+    // every value but the shard name is a number
+    auto object = [] (const std::vector<std::pair<sstring, sstring>> &row) {
+        sstring text = "{";
+        for (auto &[name, value] : row) {
+            auto quoted = name == "shard" && value == "total";
+            text += format("{}\"{}\": {}{}{}", text.size() > 1? ", " : "", name, quoted? "\"" : "", value, quoted? "\"" : "");
+        }
+        return text + "}";
+    };
+    text += format("{{\"elapsed_s\": {:.3f}, \"shards\": [\n", seconds);
+    for (auto i = 0u; i + 1 < rows.size(); i++) {
+        text += format("  {}{}\n", object(rows[i]), i + 2 < rows.size()? "," : "");
+    }
+    text += format("], \"total\": {}}}\n", object(rows.back()));
+    return text;
+}
+
 class http_client {
+    using time_point = steady_clock_type::time_point;
+    // requests of one connection, tagged with the time they were due and their step
+    struct lane {
+        http2_connection<session_t::client> *conn;
+        // due time, step and when the response headers arrived
+        std::unordered_map<int32_t, std::tuple<time_point, unsigned, std::optional<time_point>>> in_flight;
+        std::deque<std::pair<time_point, unsigned>> backlog;
+        bool dirty {false};
+    };
 public:
     future<> connect(const uint16_t connections, ipv4_addr server_addr, bool with_tls) {
         if (!with_tls) {
@@ -67,7 +271,41 @@ public:
         }
     }
 
+    // connections opened by connect_one, e.g. in-memory loopback sockets
+    future<> connect(const uint16_t connections, std::function<future<connected_socket>()> connect_one) {
+        return parallel_for_each(boost::irange<uint16_t>(0, connections), [this, connect_one] (uint16_t) {
+            return connect_one().then([this] (connected_socket fd) {
+                _sockets.push_back(std::move(fd));
+            });
+        });
+    }
+
     future<> send_burst(unsigned requests, lw_shared_ptr<request> req, http2_connection<session_t::client> *conn) {
+        // all requests of the burst are submitted now, queued ones included
+        auto submitted = steady_clock_type::now();
+        _sent += requests;
+        // ttfb is recorded once the stream is known to have completed, a reset
+        // stream (e.g. REFUSED_STREAM) would otherwise count as a fast response
+        auto headers_at = make_lw_shared<std::unordered_map<int32_t, time_point>>();
+        conn->observe_streams({
+            [headers_at] (int32_t stream_id) {
+                headers_at->emplace(stream_id, steady_clock_type::now());
+            },
+            [this, submitted, headers_at] (int32_t stream_id, uint32_t error_code) {
+                auto it = headers_at->find(stream_id);
+                if (error_code != NGHTTP2_NO_ERROR) {
+                    _failed_requests++;
+                } else {
+                    if (it != headers_at->end()) {
+                        _latencies.ttfb.record(it->second - submitted);
+                    }
+                    _latencies.full.record(steady_clock_type::now() - submitted);
+                }
+                if (it != headers_at->end()) {
+                    headers_at->erase(it);
+                }
+            }
+        });
         for (auto _ = requests; _ > 0; _--) {
             auto rv = conn->submit_request(req);
             if (rv < 0) {
@@ -79,15 +317,17 @@ public:
     }
 
     future<> run(request *req, const uint16_t reqs) {
-        fmt::print("established tcp connections\n");
         ipv4_addr server_addr = {"127.0.0.1", 3000u};
         _common_reqs = make_lw_shared<request>(*req);
         _common_reqs->done();
-        for (auto &&socket : _sockets) {
+        // every connection serves one burst, connect() again before the next run()
+        auto sockets = std::exchange(_sockets, {});
+        for (auto &&socket : sockets) {
             auto conn = new http2_connection<session_t::client>(_routes, std::move(socket), std::move(make_ipv4_address(server_addr)));
             send_burst(reqs, _common_reqs, conn)
                     .then_wrapped([this, conn] (auto&& f) {
                         _conn_finished.signal();
+                        _traffic.merge(conn->stats());
                         conn->shutdown();
                         delete conn;
                         try {
@@ -97,17 +337,272 @@ public:
                         }
                 });
         }
-        return _conn_finished.wait(_sockets.size());
+        return _conn_finished.wait(sockets.size());
+    }
+
+    /*
+     * Open-loop mode: requests are due on a fixed timetable regardless of how
+     * fast responses come back, round-robin over the connections. Requests the
+     * connection has no stream for wait in its backlog and a late timer sends
+     * everything that became due meanwhile, either way latency keeps counting
+     * from the due time, so queueing delay isn't hidden (coordinated omission).
+     */
+    future<> run_at_rate(request *req, rate_plan plan) {
+        ipv4_addr server_addr = {"127.0.0.1", 3000u};
+        _common_reqs = make_lw_shared<request>(*req);
+        _common_reqs->done();
+        for (auto &&socket : _sockets) {
+            auto conn = new http2_connection<session_t::client>(_routes, std::move(socket), std::move(make_ipv4_address(server_addr)));
+            auto &l = _lanes.emplace_back(lane{conn});
+            conn->keep_open(true);
+            conn->observe_streams({
+                [this, &l] (int32_t stream_id) {
+                    on_response_headers(l, stream_id);
+                },
+                [this, &l] (int32_t stream_id, uint32_t error_code) {
+                    on_response(l, stream_id, error_code);
+                }
+            });
+            conn->process_internal(false).then_wrapped([this, conn, &l] (auto&& f) {
+                _conn_finished.signal();
+                l.conn = nullptr;
+                _traffic.merge(conn->stats());
+                conn->shutdown();
+                delete conn;
+                try {
+                    f.get();
+                } catch (const std::exception& exception) {
+                    fmt::print("http request error: {}\n", exception.what());
+                }
+            });
+        }
+        return do_with(0u, [this, plan] (unsigned &step) {
+            return do_until([&step, plan] { return step == plan.steps; }, [this, &step, plan] {
+                auto rate = plan.rate + step * plan.rate_step;
+                _steps.push_back(step_result{rate});
+                return run_step(step, rate, plan.step_duration).then([&step] {
+                    ++step;
+                });
+            });
+        }).then([this] {
+            return parallel_for_each(_lanes, [] (lane &l) {
+                return l.conn? l.conn->finish() : make_ready_future<>();
+            });
+        }).then([this] {
+            return _conn_finished.wait(_lanes.size());
+        });
     }
 
     future<> stop() { return make_ready_future(); }
     future<uint64_t> responses() { return make_ready_future<uint64_t>(_responses); }
+    /*
+     * Workload mode: concurrency * connections loops per shard, each sending a
+     * request drawn from the weighted templates, reading the whole response and
+     * thinking before the next one. As with http1_client, the connections are
+     * all opened up front and each loop sticks to one of them, every
+     * connection being an upstream of its own.
+     */
+    future<> run_workload(workload w, ipv4_addr server_addr) {
+        upstream_config cfg;
+        cfg.server = make_ipv4_address(server_addr);
+        cfg.authority = format("{}", server_addr);
+        cfg.max_connections = 1;
+        _upstreams.clear();
+        for (auto i = 0u; i < w.connections; i++) {
+            _upstreams.push_back(std::make_unique<upstream>(cfg));
+        }
+        _workload = std::move(w);
+        _workload_results.assign(_workload.requests.size(), template_result());
+        for (const auto &t : _workload.requests) {
+            auto headers = t.headers;
+            if (t.body_size) {
+                headers.emplace_back("content-length", to_sstring(t.body_size));
+            }
+            auto req = _upstreams.front()->make_request(t.method, t.path, std::move(headers));
+            req->_body = sstring(t.body_size, 'x');
+            _templates.push_back(std::move(req));
+            _choice.add(t.weight);
+        }
+        return parallel_for_each(_upstreams, [] (std::unique_ptr<upstream> &up) {
+            return up->connect();
+        }).then([this] {
+            auto loops = _workload.connections * _workload.concurrency;
+            auto start = steady_clock_type::now();
+            auto end = start + _workload.ramp_up + _workload.duration;
+            return parallel_for_each(boost::irange(0u, loops), [this, loops, end] (unsigned i) {
+                auto &up = *_upstreams[i % _upstreams.size()];
+                return sleep(_workload.ramp_up * i / loops).then([this, &up, end] {
+                    return do_until([end] { return steady_clock_type::now() >= end; }, [this, &up] {
+                        return send_one(up).then([this] {
+                            return _workload.think_time.count()? sleep(_workload.think_time) : make_ready_future<>();
+                        });
+                    });
+                });
+            });
+        }).finally([this] {
+            return parallel_for_each(_upstreams, [this] (std::unique_ptr<upstream> &up) {
+                return up->close().then([this, &up] {
+                    _traffic.merge(up->stats());
+                });
+            });
+        });
+    }
+
+    std::vector<step_result> step_results() const { return _steps; }
+    std::vector<template_result> workload_results() const { return _workload_results; }
+
+    shard_result result() const {
+        shard_result r;
+        r.shard = engine().cpu_id();
+        r.sent = _sent;
+        r.responses = _responses;
+        r.failed_requests = _failed_requests;
+        r.traffic = _traffic;
+        // only the mode that ran recorded anything
+        r.latencies = _latencies;
+        for (auto &step : _steps) {
+            r.latencies.merge(step.latencies);
+        }
+        for (auto &t : _workload_results) {
+            r.latencies.merge(t.latencies);
+        }
+        r.cpu_time = thread_cpu_time() - _cpu_time_at_start;
+        return r;
+    }
+    client_latencies latencies() const { return _latencies; }
     routes _routes;
     uint64_t _responses{0}, _failed_requests {0};
 private:
+    future<> run_step(unsigned step, double rate, std::chrono::milliseconds duration) {
+        auto period = std::chrono::duration_cast<steady_clock_type::duration>(std::chrono::duration<double>(1.0 / rate));
+        auto end = steady_clock_type::now() + duration;
+        return do_with(steady_clock_type::now(), [this, step, period, end] (time_point &due) {
+            return do_until([&due, end] { return due >= end; }, [this, &due, step, period, end] {
+                auto now = steady_clock_type::now();
+                for (; due <= now && due < end; due += period) {
+                    send(next_lane(), due, step);
+                }
+                return parallel_for_each(_lanes, [] (lane &l) {
+                    if (!std::exchange(l.dirty, false) || !l.conn) {
+                        return make_ready_future<>();
+                    }
+                    return l.conn->send_requests();
+                }).then([&due] {
+                    auto wait = due - steady_clock_type::now();
+                    return wait.count() > 0? sleep(wait) : make_ready_future<>();
+                });
+            });
+        });
+    }
+
+    future<> send_one(upstream &up) {
+        auto i = _choice.pick();
+        auto &result = _workload_results[i];
+        auto sent = steady_clock_type::now();
+        ++result.sent;
+        ++_sent;
+        return up.send(_templates[i]).then([&result, sent] (client_response rep) {
+            result.latencies.ttfb.record(steady_clock_type::now() - sent);
+            if (rep.status >= 400) {
+                ++result.errors;
+            }
+            return do_with(std::move(rep), [] (client_response &rep) {
+                return repeat([&rep] {
+                    return rep.body.read().then([] (temporary_buffer<char> chunk) {
+                        return chunk.empty()? stop_iteration::yes : stop_iteration::no;
+                    });
+                }).then([&rep] {
+                    return rep.body.close();
+                });
+            }).then([this, &result, sent] {
+                result.latencies.full.record(steady_clock_type::now() - sent);
+                ++_responses;
+            });
+        }).handle_exception([this, &result] (std::exception_ptr) {
+            ++result.errors;
+            ++_failed_requests;
+        });
+    }
+
+    lane &next_lane() {
+        _next_lane = (_next_lane + 1) % _lanes.size();
+        return _lanes[_next_lane];
+    }
+
+    void send(lane &l, time_point due, unsigned step) {
+        ++_steps[step].sent;
+        ++_sent;
+        if (!l.conn) {
+            _failed_requests++;
+            return;
+        }
+        if (!l.conn->can_submit()) {
+            l.backlog.emplace_back(due, step);
+            return;
+        }
+        submit(l, due, step);
+        l.dirty = true;
+    }
+
+    void submit(lane &l, time_point due, unsigned step) {
+        auto stream_id = l.conn->submit_request(_common_reqs);
+        if (stream_id <= 0) {
+            _failed_requests++;
+            return;
+        }
+        l.in_flight.emplace(stream_id, std::make_tuple(due, step, std::nullopt));
+    }
+
+    void on_response_headers(lane &l, int32_t stream_id) {
+        auto it = l.in_flight.find(stream_id);
+        if (it == l.in_flight.end() || std::get<2>(it->second)) {
+            return;
+        }
+        std::get<2>(it->second) = steady_clock_type::now();
+    }
+
+    // a reset stream, e.g. REFUSED_STREAM from an overloaded server, is an
+    // error of its step and stays out of the latencies
+    void on_response(lane &l, int32_t stream_id, uint32_t error_code) {
+        auto it = l.in_flight.find(stream_id);
+        if (it == l.in_flight.end()) {
+            return;
+        }
+        auto &[due, step, headers_at] = it->second;
+        if (error_code != NGHTTP2_NO_ERROR) {
+            ++_steps[step].errors;
+            _failed_requests++;
+        } else {
+            if (headers_at) {
+                _steps[step].latencies.ttfb.record(*headers_at - due);
+            }
+            _steps[step].latencies.full.record(steady_clock_type::now() - due);
+        }
+        l.in_flight.erase(it);
+        if (!l.backlog.empty()) {
+            // sent by the receive loop which is running this callback
+            auto next = l.backlog.front();
+            l.backlog.pop_front();
+            submit(l, next.first, next.second);
+        }
+    }
+
     semaphore _conn_connected{0}, _conn_finished{0};
     std::vector<connected_socket> _sockets;
     lw_shared_ptr<request> _common_reqs;
+    std::deque<lane> _lanes;
+    size_t _next_lane {0};
+    std::vector<step_result> _steps;
+    client_latencies _latencies;
+    workload _workload;
+    // one per connection, see run_workload()
+    std::vector<std::unique_ptr<upstream>> _upstreams;
+    std::vector<lw_shared_ptr<request>> _templates;
+    weighted_choice _choice;
+    std::vector<template_result> _workload_results;
+    uint64_t _sent {0};
+    connection_stats _traffic;
+    std::chrono::nanoseconds _cpu_time_at_start {thread_cpu_time()};
 };
 
 }
@@ -0,0 +1,165 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2018 ScyllaDB Ltd.
+ */
+
+#include "http2_compression.hh"
+#include <zlib.h>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <functional>
+#include <stdexcept>
+#include <string_view>
+
+namespace seastar {
+namespace httpd2 {
+
+static std::string_view trim(std::string_view s) {
+    auto begin = s.find_first_not_of(" \t");
+    if (begin == std::string_view::npos) {
+        return {};
+    }
+    auto end = s.find_last_not_of(" \t");
+    return s.substr(begin, end - begin + 1);
+}
+
+static bool same_token(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+        return std::tolower(x) == std::tolower(y);
+    });
+}
+
+bool accepts_encoding(const sstring &accept_encoding, const char *coding) {
+    std::string_view header(accept_encoding.data(), accept_encoding.size());
+    auto accepted = false;
+    while (!header.empty()) {
+        auto comma = header.find(',');
+        auto item = header.substr(0, comma);
+        header = (comma == std::string_view::npos)? std::string_view() : header.substr(comma + 1);
+
+        auto semicolon = item.find(';');
+        auto token = trim(item.substr(0, semicolon));
+        auto q = 1.0;
+        if (semicolon != std::string_view::npos) {
+            auto param = trim(item.substr(semicolon + 1));
+            if (param.size() > 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+                q = std::strtod(sstring(param.data() + 2, param.size() - 2).c_str(), nullptr);
+            }
+        }
+        if (same_token(token, coding)) {
+            // an explicit entry wins over "*"
+            return q > 0;
+        }
+        if (token == "*") {
+            accepted = q > 0;
+        }
+    }
+    return accepted;
+}
+
+body_chunks gzip(const char *data, size_t size, size_t chunk_size) {
+    z_stream zs{};
+    // 16 added to window bits selects the gzip wrapper
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw std::runtime_error("deflateInit2 failed");
+    }
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    zs.avail_in = size;
+    // small bodies shouldn't pay for a full frame sized buffer
+    auto buffer_size = std::min<size_t>(chunk_size, deflateBound(&zs, size));
+    body_chunks out;
+    int rv;
+    do {
+        temporary_buffer<char> buf(buffer_size);
+        zs.next_out = reinterpret_cast<Bytef*>(buf.get_write());
+        zs.avail_out = buf.size();
+        rv = deflate(&zs, Z_FINISH);
+        buf.trim(buf.size() - zs.avail_out);
+        if (!buf.empty()) {
+            out.push_back(std::move(buf));
+        }
+    } while (rv == Z_OK);
+    deflateEnd(&zs);
+    if (rv != Z_STREAM_END) {
+        throw std::runtime_error("deflate failed");
+    }
+    return out;
+}
+
+size_t chunks_size(const body_chunks &chunks) {
+    size_t size = 0;
+    for (const auto &chunk : chunks) {
+        size += chunk.size();
+    }
+    return size;
+}
+
+sstring body_validator(const sstring &body) {
+    // a collision needs the same path, the same length and the same hash
+    auto hash = std::hash<std::string_view>()(std::string_view(body.data(), body.size()));
+    return to_sstring(body.size()) + "-" + to_sstring(hash);
+}
+
+body_chunks compression_cache::get(const sstring &path, const sstring &validator) {
+    auto it = _index.find(path);
+    if (it == _index.end() || it->second->validator != validator) {
+        ++_misses;
+        return {};
+    }
+    ++_hits;
+    _lru.splice(_lru.begin(), _lru, it->second);
+    body_chunks shares;
+    shares.reserve(it->second->compressed.size());
+    for (auto &chunk : it->second->compressed) {
+        shares.push_back(chunk.share());
+    }
+    return shares;
+}
+
+void compression_cache::put(const sstring &path, const sstring &validator, body_chunks &compressed) {
+    auto it = _index.find(path);
+    if (it != _index.end()) {
+        erase(it->second);
+    }
+    auto bytes = path.size() + validator.size() + chunks_size(compressed);
+    if (bytes > _max_bytes) {
+        return;
+    }
+    body_chunks shares;
+    shares.reserve(compressed.size());
+    for (auto &chunk : compressed) {
+        shares.push_back(chunk.share());
+    }
+    _lru.push_front(entry{path, validator, std::move(shares), bytes});
+    _index.emplace(path, _lru.begin());
+    _bytes += bytes;
+    while (_bytes > _max_bytes) {
+        erase(std::prev(_lru.end()));
+    }
+}
+
+void compression_cache::erase(std::list<entry>::iterator it) {
+    _bytes -= it->bytes;
+    _index.erase(it->path);
+    _lru.erase(it);
+}
+
+}
+}
@@ -0,0 +1,92 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2018 ScyllaDB Ltd.
+ */
+
+#pragma once
+
+#include "core/sstring.hh"
+#include "core/temporary_buffer.hh"
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+namespace seastar {
+namespace httpd2 {
+
+using body_chunks = std::vector<temporary_buffer<char>>;
+
+// true when the accept-encoding value allows given coding, i.e. it is listed
+// (or covered by "*") without q=0
+bool accepts_encoding(const sstring &accept_encoding, const char *coding);
+
+// gzip of a whole, already buffered body. The output is cut into buffers of at
+// most chunk_size bytes so that each of them can go out as a DATA frame
+// without copying, the compression itself is not incremental.
+body_chunks gzip(const char *data, size_t size, size_t chunk_size = 16384);
+
+size_t chunks_size(const body_chunks &chunks);
+
+// length and 64-bit hash of body, for telling bodies of one path apart
+sstring body_validator(const sstring &body);
+
+/*
+ * Per-shard LRU of gzip-compressed dynamic bodies, keyed by path. Each entry
+ * remembers a validator of the identity body it was made from (a strong ETag,
+ * or body_validator()) and is reused while the handler keeps producing a body
+ * with the same validator. Hashing a body is much cheaper than compressing it
+ * again, and the identity body itself is not kept.
+ */
+class compression_cache {
+public:
+    explicit compression_cache(size_t max_bytes = 16 << 20)
+        : _max_bytes(max_bytes) {}
+
+    // shares of the cached compressed body, empty on miss
+    body_chunks get(const sstring &path, const sstring &validator);
+    void put(const sstring &path, const sstring &validator, body_chunks &compressed);
+
+    uint64_t hits() const {
+        return _hits;
+    }
+    uint64_t misses() const {
+        return _misses;
+    }
+    size_t bytes() const {
+        return _bytes;
+    }
+private:
+    struct entry {
+        sstring path;
+        sstring validator;
+        body_chunks compressed;
+        size_t bytes;
+    };
+    void erase(std::list<entry>::iterator it);
+
+    size_t _max_bytes;
+    size_t _bytes {0};
+    uint64_t _hits {0};
+    uint64_t _misses {0};
+    std::list<entry> _lru;
+    std::unordered_map<sstring, std::list<entry>::iterator> _index;
+};
+
+}
+}
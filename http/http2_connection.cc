@@ -20,12 +20,53 @@
  */
 
 #include "http2_connection.hh"
+#include "util/defer.hh"
 
 namespace seastar {
 namespace httpd2 {
 
 future<> http2_stream::eat_request(bool promised_stream) {
-    auto user_handler = (!promised_stream)? _routes.handle(_req->_path) : _routes.handle_push();
+    auto key = promised_stream? std::nullopt : flight_key();
+    if (!key) {
+        return run_handler(promised_stream);
+    }
+    auto &flights = _routes._single_flight;
+    if (auto leader = flights.join(*key)) {
+        return leader->then([this] (single_flight::result shared) {
+            _rep = std::make_unique<response>();
+            shared->restore(*_rep);
+        });
+    }
+    return run_handler(false).then_wrapped([this, key = std::move(*key)] (future<> f) {
+        auto &flights = _routes._single_flight;
+        if (f.failed()) {
+            auto ex = f.get_exception();
+            flights.fail(key, ex);
+            return make_exception_future<>(std::move(ex));
+        }
+        flights.complete(key, *_rep);
+        return make_ready_future<>();
+    });
+}
+
+std::optional<sstring> http2_stream::flight_key() const {
+    // conditional and range requests get responses of their own
+    if ((_req->_method != "GET" && _req->_method != "HEAD") || !_req->_if_none_match.empty()
+            || !_req->_if_modified_since.empty() || !_req->_range.empty()) {
+        return std::nullopt;
+    }
+    if (!_routes.handle(_req->_path)) {
+        // the file variant picked depends on all of accept-encoding
+        return _req->_method + " " + _req->_path + " " + _req->_accept_encoding;
+    }
+    if (!_routes.cacheable(_req->_path)) {
+        return std::nullopt;
+    }
+    return response_cache::key(*_req, bool(_routes.gzip_threshold(_req->_path)));
+}
+
+future<> http2_stream::run_handler(bool promised_stream) {
+    const auto &user_handler = (!promised_stream)? _routes.handle(_req->_path) : _routes.handle_push();
     if (!user_handler) {
         _rep = std::make_unique<response>();
         auto user_file_handler = _routes._directory_handler;
@@ -42,20 +83,67 @@ future<> http2_stream::eat_request(bool promised_stream) {
                 .then([this](auto req_rep){
             std::tie(_req, _rep) = std::move(req_rep);
             assert(_req && _rep);
+            compress_response(_routes, *_req, *_rep);
+            if (_routes.cacheable(*_req)) {
+                auto key = response_cache::key(*_req, bool(_routes.gzip_threshold(_req->_path)));
+                _routes._response_cache.store(key, *_rep);
+            }
             return make_ready_future<>();
         });
     }
 }
 
+void http2_stream::compress_response(routes &routes_, const request &req, response &rep) {
+    auto threshold = routes_.gzip_threshold(req._path);
+    if (!threshold) {
+        return;
+    }
+    rep.add_header("vary", "accept-encoding");
+    if (rep._status_code != 200u || rep._body.size() < *threshold || !rep._body_chunks.empty()
+            || !accepts_encoding(req._accept_encoding, "gzip")) {
+        return;
+    }
+    // a strong ETag names the identity body, otherwise it is hashed
+    sstring validator;
+    for (const auto &header : rep.headers()) {
+        if (header.first == "etag" && !header.second.empty() && header.second[0] == '"') {
+            validator = header.second;
+            break;
+        }
+    }
+    if (validator.empty()) {
+        validator = body_validator(rep._body);
+    }
+    auto &cache = routes_._compression_cache;
+    auto compressed = cache.get(req._path, validator);
+    if (compressed.empty()) {
+        compressed = gzip(rep._body.data(), rep._body.size());
+        cache.put(req._path, validator, compressed);
+    }
+    rep._body_chunks = std::move(compressed);
+    rep._body = "";
+    rep.add_header("content-encoding", "gzip");
+}
+
 void http2_stream::commit_response(bool promised) {
     if (!promised) {
+        if (_req && _req->_method == "HEAD") {
+            if (!_rep->_content_length) {
+                _rep->_content_length = _rep->body_size();
+            }
+            _rep->_header_only = true;
+        }
         _rep->flush_body();
         _rep->clear();
         sstring status = (_rep->_status_code == 200)? "200" : to_sstring(_rep->_status_code);
-        sstring length = to_sstring(static_cast<int>(_rep->_body.size()));
-        _rep->add_headers({{":status", status},
-                           {"date", *_routes._date},
-                           {"content-length", length}});
+        _rep->add_status_header(status);
+        if (_rep->_status_code == 304u) {
+            _rep->add_headers({{"date", *_routes._date}});
+        } else {
+            sstring length = to_sstring(_rep->_content_length? *_rep->_content_length : _rep->body_size());
+            _rep->add_headers({{"date", *_routes._date},
+                               {"content-length", length}});
+        }
     } else {
         _rep->clear();
     }
@@ -64,42 +152,109 @@ void http2_stream::commit_response(bool promised) {
 
 template<session_t session_type>
 http2_connection<session_type>::http2_connection(routes &routes_, connected_socket&& fd, socket_address addr)
-    : _fd(std::move(fd)), _read_buf(_fd.input()), _write_buf(_fd.output()), _routes(routes_) {
-    if constexpr (session_type == session_t::client) {
-        assert(_routes._client_handler);
-    }
+    : _session_memory(routes_._session_memory_budget)
+    , _fd(std::move(fd)), _read_buf(_fd.input()), _write_buf(_fd.output()), _routes(routes_)
+    , _flood_guard(routes_._flood_stats) {
     if (debug_on) {
         fmt::print("new session: {}\n", addr);
     }
-    nghttp2_session_callbacks *callbacks;
-    static auto get_impl = [](void *ptr) { return reinterpret_cast<http2_connection*>(ptr); };
-    int rv = nghttp2_session_callbacks_new(&callbacks);
-    if (rv != 0) {
-        throw nghttp2_exception("nghttp2_session_callbacks_new", rv);
+    int rv;
+    if constexpr (session_type == session_t::client) {
+        nghttp2_option *option = nullptr;
+        if (_routes._manual_window_update) {
+            rv = nghttp2_option_new(&option);
+            if (rv != 0) {
+                throw nghttp2_exception("nghttp2_option_new", rv);
+            }
+            nghttp2_option_set_no_auto_window_update(option, 1);
+        }
+        rv = nghttp2_session_client_new3(&_session, callbacks(), this, option, _session_memory.get());
+        nghttp2_option_del(option);
+        if (rv != 0 || !_session) {
+            throw nghttp2_exception("nghttp2_session_client_new3", rv);
+        }
+        rv = nghttp2_submit_settings(_session, NGHTTP2_FLAG_NONE, nullptr, 0);
+        if (rv != 0) {
+            throw nghttp2_exception("nghttp2_submit_settings", rv);
+        }
+    } else {
+        rv = nghttp2_session_server_new3(&_session, callbacks(), this, nullptr, _session_memory.get());
+        if (rv != 0 || !_session) {
+            throw nghttp2_exception("nghttp2_session_server_new3", rv);
+        }
+        if (_routes._admission) {
+            _advertised_streams_limit = _routes._admission->streams_limit();
+        }
+        nghttp2_settings_entry entry{NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, _advertised_streams_limit};
+        rv = nghttp2_submit_settings(_session, NGHTTP2_FLAG_NONE, &entry, 1);
+        if (rv != 0) {
+            throw nghttp2_exception("nghttp2_submit_settings", rv);
+        }
+        _idle_timer.set_callback([this] {
+            if (_done || !_streams.empty()) {
+                return;
+            }
+            compact();
+            with_gate(_handlers, [this] {
+                return process_send();
+            });
+        });
     }
+}
+
+template<session_t session_type>
+nghttp2_session_callbacks *http2_connection<session_type>::callbacks() {
+    // nghttp2 copies the table into each session, so build it once per shard
+    struct callbacks_holder {
+        nghttp2_session_callbacks *callbacks {nullptr};
+        callbacks_holder() {
+            int rv = nghttp2_session_callbacks_new(&callbacks);
+            if (rv != 0) {
+                throw nghttp2_exception("nghttp2_session_callbacks_new", rv);
+            }
+            set_callbacks(callbacks);
+        }
+        ~callbacks_holder() {
+            nghttp2_session_callbacks_del(callbacks);
+        }
+    };
+    static thread_local callbacks_holder holder;
+    return holder.callbacks;
+}
+
+template<session_t session_type>
+void http2_connection<session_type>::set_callbacks(nghttp2_session_callbacks *callbacks) {
+    static auto get_impl = [](void *ptr) { return reinterpret_cast<http2_connection*>(ptr); };
     if constexpr (session_type == session_t::client) {
         nghttp2_session_callbacks_set_on_frame_send_callback(callbacks,
             [](nghttp2_session *, const nghttp2_frame *frame, void *user_data) {
                 http2_connection* con = get_impl(user_data);
-                return con->consume_frame<ops::on_frame_send>(frame);
+                return con->on_frame_send(frame);
             });
 
         nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks,
             [](nghttp2_session*, const nghttp2_frame *frame, void *user_data) {
                 http2_connection* con = get_impl(user_data);
-                return con->consume_frame<ops::on_frame_recv>(frame);
+                return con->on_frame_recv(frame);
             });
 
         nghttp2_session_callbacks_set_on_stream_close_callback(callbacks,
-            [](nghttp2_session*, int32_t stream_id, uint32_t, void *user_data) {
+            [](nghttp2_session*, int32_t stream_id, uint32_t error_code, void *user_data) {
+                http2_connection* con = get_impl(user_data);
+                return con->on_stream_close(stream_id, error_code);
+            });
+
+        nghttp2_session_callbacks_set_on_header_callback(callbacks,
+            [](nghttp2_session*, const nghttp2_frame *frame, const uint8_t *name, size_t namelen,
+                            const uint8_t *value, size_t valuelen, uint8_t, void *user_data) {
                 http2_connection* con = get_impl(user_data);
-                return con->consume_frame<ops::on_stream_close>(stream_id);
+                return con->on_header(frame, name, namelen, value, valuelen);
             });
 
         nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks,
-            [](nghttp2_session*, uint8_t, int32_t, const uint8_t *data, size_t len, void *user_data) {
+            [](nghttp2_session*, uint8_t, int32_t stream_id, const uint8_t *data, size_t len, void *user_data) {
                 http2_connection* con = get_impl(user_data);
-                return con->consume_frame<ops::on_data_chunk_recv>(std::make_tuple(data, len));
+                return con->on_data_chunk_recv(stream_id, data, len);
             });
 
         nghttp2_session_callbacks_set_error_callback2(callbacks,
@@ -107,58 +262,49 @@ http2_connection<session_type>::http2_connection(routes &routes_, connected_sock
                 fmt::print("error: {} {}\n", lib_error_code, msg);
                 return static_cast<int>(NGHTTP2_ERR_CALLBACK_FAILURE);
             });
-        rv = nghttp2_session_client_new(&_session, callbacks, this);
-        nghttp2_session_callbacks_del(callbacks);
-        if (rv != 0 || !_session) {
-            throw nghttp2_exception("nghttp2_session_client_new", rv);
-        }
-        rv = nghttp2_submit_settings(_session, NGHTTP2_FLAG_NONE, nullptr, 0);
-        if (rv != 0) {
-            throw nghttp2_exception("nghttp2_submit_settings", rv);
-        }
     } else {
         nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks,
             [](nghttp2_session*, const nghttp2_frame *frame, void *user_data) {
                 http2_connection* con = get_impl(user_data);
-                return con->consume_frame<ops::on_begin_headers>(frame);
+                return con->on_begin_headers(frame);
             });
 
         nghttp2_session_callbacks_set_on_header_callback(callbacks,
             [](nghttp2_session*, const nghttp2_frame *frame, const uint8_t *name, size_t namelen,
                             const uint8_t *value, size_t valuelen, uint8_t, void *user_data) {
                 http2_connection* con = get_impl(user_data);
-                return con->consume_frame<ops::on_header>(std::make_tuple(frame,
-                                    std::make_tuple(name, namelen, value, valuelen)));
+                return con->on_header(frame, name, namelen, value, valuelen);
             });
 
         nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks,
             [](nghttp2_session*, const nghttp2_frame *frame, void *user_data) {
                 http2_connection* con = get_impl(user_data);
-                return con->consume_frame<ops::on_frame_recv>(frame);
+                return con->on_frame_recv(frame);
             });
 
         nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks,
-            [](nghttp2_session*, uint8_t, int32_t, const uint8_t*, size_t, void *user_data) {
+            [](nghttp2_session*, uint8_t, int32_t stream_id, const uint8_t *data, size_t len, void *user_data) {
                 http2_connection* con = get_impl(user_data);
-                return con->consume_frame<ops::on_data_chunk_recv>({});
+                return con->on_data_chunk_recv(stream_id, data, len);
             });
 
         nghttp2_session_callbacks_set_on_stream_close_callback(callbacks,
             [](nghttp2_session*, int32_t stream_id, uint32_t, void *user_data) {
                 http2_connection* con = get_impl(user_data);
-                return con->consume_frame<ops::on_stream_close>(stream_id);
+                return con->on_stream_close(stream_id);
             });
 
         nghttp2_session_callbacks_set_on_frame_send_callback(callbacks,
             [](nghttp2_session *, const nghttp2_frame *frame, void *user_data) {
                 http2_connection* con = get_impl(user_data);
-                return con->consume_frame<ops::on_frame_send>(frame);
+                return con->on_frame_send(frame);
             });
 
-        nghttp2_session_callbacks_set_on_frame_not_send_callback(callbacks,
-            [](nghttp2_session *, const nghttp2_frame *, int, void *user_data) {
+        nghttp2_session_callbacks_set_send_data_callback(callbacks,
+            [](nghttp2_session *, nghttp2_frame *, const uint8_t *framehd, size_t length,
+                            nghttp2_data_source *source, void *user_data) {
                 http2_connection* con = get_impl(user_data);
-                return con->consume_frame<ops::on_frame_not_send>({});
+                return con->on_send_data(framehd, length, source);
             });
 
         nghttp2_session_callbacks_set_error_callback2(callbacks,
@@ -166,24 +312,26 @@ http2_connection<session_type>::http2_connection(routes &routes_, connected_sock
                 fmt::print("error: {} {}\n", lib_error_code, msg);
                 return static_cast<int>(NGHTTP2_ERR_CALLBACK_FAILURE);
             });
-        rv = nghttp2_session_server_new(&_session, callbacks, this);
-        nghttp2_session_callbacks_del(callbacks);
-        if (rv != 0 || !_session) {
-            throw nghttp2_exception("nghttp2_session_server_new", rv);
-        }
-        nghttp2_settings_entry entry{NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, _streams_limit};
-        rv = nghttp2_submit_settings(_session, NGHTTP2_FLAG_NONE, &entry, 1);
-        if (rv != 0) {
-            throw nghttp2_exception("nghttp2_submit_settings", rv);
-        }
     }
 }
 
 template<session_t session_type>
-void http2_connection<session_type>::eat_server_rep(data_chunk_feed data) {
-    const auto *ptr = reinterpret_cast<const char*>(std::get<0>(data));
-    const sstring response(ptr, std::get<1>(data));
-    _routes._client_handler(response);
+void http2_connection<session_type>::eat_server_rep(int32_t stream_id, temporary_buffer<char> chunk, bool end_of_stream) {
+    if (_stream_observer.data) {
+        _stream_observer.data(stream_id, std::move(chunk), end_of_stream);
+    } else if (_routes._client_handler) {
+        _routes._client_handler(stream_id, std::move(chunk), end_of_stream);
+    }
+}
+
+template<session_t session_type>
+temporary_buffer<char> http2_connection<session_type>::share_rx(const uint8_t *data, size_t len) {
+    auto ptr = reinterpret_cast<const char*>(data);
+    if (_rx_buf && ptr >= _rx_buf->get() && ptr + len <= _rx_buf->get() + _rx_buf->size()) {
+        return _rx_buf->share(ptr - _rx_buf->get(), len);
+    }
+    // not expected, nghttp2 hands out DATA payloads in place
+    return temporary_buffer<char>(ptr, len);
 }
 
 void dump_buffer(temporary_buffer<char> buffer, const char *direction) {
@@ -239,17 +387,27 @@ future<> http2_connection<session_type>::process_internal(bool start_with_readin
                     temporary_buffer<char> dump(buf.get(), buf.size());
                     dump_buffer(std::move(dump), "RX");
                 }
+                if (buf.size() != 0) {
+                    rehydrate();
+                }
                 const uint8_t *data = (const uint8_t *)(buf.get());
-                receive_nghttp2(data, buf.size());
+                _rx_buf = &buf;
+                {
+                    auto forget_rx = defer([this] { _rx_buf = nullptr; });
+                    receive_nghttp2(data, buf.size());
+                }
                 if (buf.size() == 0)
                 {
                     _done = true;
                     return make_ready_future<>();
                 }
+                update_streams_limit();
             } else
                _start_with_reading = true;
 
-            return process_send();
+            return process_send().then([this] {
+                arm_idle_timer();
+            });
         });
     }).then_wrapped([this] (future<> f) {
         try {
@@ -257,7 +415,12 @@ future<> http2_connection<session_type>::process_internal(bool start_with_readin
         } catch (std::exception& ex) {
             std::cerr << "process_internal failed: " << ex.what() << std::endl;
         }
-        return _write_buf.close();
+        // handlers still running may write their responses, so wait for them first
+        _done = true;
+        _idle_timer.cancel();
+        return _handlers.close().then([this] {
+            return _write_buf.close();
+        });
     }).finally([this] {
         return _read_buf.close();
     });
@@ -270,10 +433,35 @@ future<> http2_connection<session_type>::process() {
 
 template<session_t session_type>
 future<> http2_connection<session_type>::process_send() {
+    return with_semaphore(_send_lock, 1, [this] {
+        return send_pending();
+    });
+}
+
+template<session_t session_type>
+future<> http2_connection<session_type>::send_pending() {
     auto end = make_lw_shared<bool>(false);
     return do_until([this, end] {return *end;}, [this, end] {
         const uint8_t *data = nullptr;
+        auto zero_copy = _zero_copy_writes;
         auto bytes = send_nghttp2(&data);
+        if (_zero_copy_writes) {
+            // DATA payloads queued by on_send_data precede the frame nghttp2 returned
+            auto out = std::exchange(_zero_copy_out, net::packet());
+            if (bytes != 0) {
+                out = net::packet(std::move(out), temporary_buffer<char>(reinterpret_cast<const char*>(data), bytes));
+            }
+            if (out.len() == 0) {
+                *end = true;
+                return make_ready_future<>();
+            }
+            _stats.bytes_sent += out.len();
+            // frames buffered so far have to reach the socket before the first packet
+            auto flushed = zero_copy? make_ready_future<>() : _write_buf.flush();
+            return flushed.then([this, out = std::move(out)] () mutable {
+                return _write_buf.write(std::move(out));
+            });
+        }
         if (bytes == 0) {
             *end = true;
             return make_ready_future<>();
@@ -282,6 +470,7 @@ future<> http2_connection<session_type>::process_send() {
                 temporary_buffer<char> dump(reinterpret_cast<const char*>(data), bytes);
                 dump_buffer(std::move(dump), "TX");
             }
+            _stats.bytes_sent += bytes;
             return _write_buf.write(reinterpret_cast<const char*>(data), bytes);
         }
     })
@@ -322,8 +511,21 @@ int http2_connection<session_type>::submit_push_promise(http2_stream &stream) {
 
 template<session_t session_type>
 int http2_connection<session_type>::submit_request_nghttp2(lw_shared_ptr<request> request_) {
+    static const nghttp2_data_provider body_provider = [] {
+        nghttp2_data_provider prd;
+        prd.source.ptr = nullptr;
+        prd.read_callback = [](nghttp2_session*, int32_t stream_id, uint8_t *buf, size_t length, uint32_t *flags,
+                               nghttp2_data_source*, void *user_data) -> ssize_t {
+            auto stream = reinterpret_cast<http2_connection*>(user_data)->find_stream(stream_id);
+            if (!stream) {
+                return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+            }
+            return stream->read_request_body(buf, length, flags);
+        };
+        return prd;
+    }();
     return nghttp2_submit_request(_session, nullptr, request_->data(), request_->size(),
-                                  nullptr, nullptr);
+                                  request_->_body.empty()? nullptr : &body_provider, nullptr);
 }
 
 template<session_t session_type>
@@ -331,9 +533,115 @@ void http2_connection<session_type>::reset_stream(int32_t stream_id, uint32_t er
     nghttp2_submit_rst_stream(_session, NGHTTP2_FLAG_NONE, stream_id, error_code);
 }
 
+template<session_t session_type>
+void http2_connection<session_type>::update_streams_limit() {
+    if constexpr (session_type == session_t::server) {
+        auto limit = _limiter.limit();
+        if (_routes._admission) {
+            limit = std::min(limit, _routes._admission->streams_limit());
+        }
+        // don't flood the peer with SETTINGS for every single step of the limiter
+        auto step = std::max(1u, _advertised_streams_limit / 10);
+        auto diff = (limit > _advertised_streams_limit)? limit - _advertised_streams_limit
+                                                       : _advertised_streams_limit - limit;
+        if (diff < step) {
+            return;
+        }
+        nghttp2_settings_entry entry{NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, limit};
+        auto rv = nghttp2_submit_settings(_session, NGHTTP2_FLAG_NONE, &entry, 1);
+        if (rv != 0) {
+            throw nghttp2_exception("nghttp2_submit_settings", rv);
+        }
+        _advertised_streams_limit = limit;
+    }
+}
+
+template<session_t session_type>
+void http2_connection<session_type>::submit_header_table_size(uint32_t size) {
+    nghttp2_settings_entry entry{NGHTTP2_SETTINGS_HEADER_TABLE_SIZE, size};
+    auto rv = nghttp2_submit_settings(_session, NGHTTP2_FLAG_NONE, &entry, 1);
+    if (rv != 0) {
+        throw nghttp2_exception("nghttp2_submit_settings", rv);
+    }
+}
+
+template<session_t session_type>
+void http2_connection<session_type>::arm_idle_timer() {
+    if constexpr (session_type == session_t::server) {
+        if (_compacted || _done || !_streams.empty() || _routes._idle_compact_after == lowres_clock::duration(0)) {
+            return;
+        }
+        _idle_timer.rearm(lowres_clock::now() + _routes._idle_compact_after);
+    }
+}
+
+template<session_t session_type>
+void http2_connection<session_type>::compact() {
+    // An idle connection keeps only the socket and a bare nghttp2 session.
+    // The stream map's bucket array survives clear(), so swap it with an empty
+    // one, and ask the peer to stop indexing headers. nghttp2 evicts the whole
+    // HPACK decoder table once the peer acknowledges the new size.
+    if (_compacted || _done || !_streams.empty()) {
+        return;
+    }
+    decltype(_streams)().swap(_streams);
+    last_active_stream = {-1, nullptr};
+    submit_header_table_size(0);
+    _compacted = true;
+}
+
+template<session_t session_type>
+void http2_connection<session_type>::rehydrate() {
+    if (!_compacted) {
+        return;
+    }
+    // the peer keeps encoding without indexing until it sees this, which is still valid
+    submit_header_table_size(NGHTTP2_DEFAULT_HEADER_TABLE_SIZE);
+    _compacted = false;
+}
+
+template<session_t session_type>
+bool http2_connection<session_type>::detect_abuse(const nghttp2_frame *frame) {
+    switch (frame->hd.type) {
+    case NGHTTP2_RST_STREAM:
+        return note_abuse(abuse::reset);
+    case NGHTTP2_SETTINGS:
+    case NGHTTP2_PING:
+        if (!(frame->hd.flags & NGHTTP2_FLAG_ACK)) {
+            return note_abuse(abuse::control_frame);
+        }
+        break;
+    case NGHTTP2_DATA:
+        if (frame->hd.length == 0 && !(frame->hd.flags & NGHTTP2_FLAG_END_STREAM)) {
+            return note_abuse(abuse::empty_data);
+        }
+        break;
+    default:
+        break;
+    }
+    return _flood_guard.tripped();
+}
+
+template<session_t session_type>
+bool http2_connection<session_type>::note_abuse(abuse kind) {
+    if (_flood_guard.tripped()) {
+        return true;
+    }
+    if (_flood_guard.on_event(kind)) {
+        if (_routes._flood_stats) {
+            _routes._flood_stats->count_goaway();
+        }
+        auto rv = nghttp2_session_terminate_session(_session, NGHTTP2_ENHANCE_YOUR_CALM);
+        if (rv != 0) {
+            throw nghttp2_exception("nghttp2_session_terminate_session", rv);
+        }
+    }
+    return _flood_guard.tripped();
+}
+
 template<session_t session_type>
 int http2_connection<session_type>::submit_request(lw_shared_ptr<request> request_) {
-    if (pending_streams() < _streams_limit) {
+    if (pending_streams() < streams_limit()) {
         auto stream_id = submit_request_nghttp2(request_);
         if (stream_id >= 0) {
             create_stream(stream_id, request_);
@@ -345,9 +653,43 @@ int http2_connection<session_type>::submit_request(lw_shared_ptr<request> reques
     }
 }
 
+template<session_t session_type>
+void http2_connection<session_type>::consume(int32_t stream_id, size_t len) {
+    if (_done || !len) {
+        return;
+    }
+    // a closed stream still has the connection window to give back
+    auto rv = nghttp2_session_consume(_session, stream_id, len);
+    if (rv != 0) {
+        throw nghttp2_exception("nghttp2_session_consume", rv);
+    }
+}
+
+template<session_t session_type>
+future<> http2_connection<session_type>::send_requests() {
+    if (_done) {
+        return make_ready_future<>();
+    }
+    return with_gate(_handlers, [this] {
+        return process_send();
+    });
+}
+
+template<session_t session_type>
+future<> http2_connection<session_type>::finish() {
+    _keep_open = false;
+    if (!_done && _remaining_reqs.empty() && pending_streams() == 0) {
+        auto rc = nghttp2_session_terminate_session(_session, NGHTTP2_NO_ERROR);
+        if (rc != 0) {
+            throw nghttp2_exception("nghttp2_session_terminate_session", rc);
+        }
+    }
+    return send_requests();
+}
+
 template<session_t session_type>
 int http2_connection<session_type>::handle_remaining_reqs() {
-    if (!_remaining_reqs.empty() && (pending_streams()-1) < _streams_limit) {
+    if (!_remaining_reqs.empty() && (pending_streams()-1) < streams_limit()) {
         auto rc = submit_request(_remaining_reqs.back());
         _remaining_reqs.pop_back();
         return rc;
@@ -369,6 +711,7 @@ void http2_connection<session_type>::dump_frame(nghttp2_frame_type frame_type, c
 
 template<session_t session_type>
 void http2_connection<session_type>::receive_nghttp2(const uint8_t *data, size_t len) {
+    _stats.bytes_received += len;
     auto rv = nghttp2_session_mem_recv(_session, data, len);
     if (rv < 0) {
         throw nghttp2_exception("nghttp2_session_mem_recv", rv);
@@ -389,139 +732,298 @@ static int error() {
 }
 
 template<session_t session_type>
-template<ops state>
-int http2_connection<session_type>::consume_frame(nghttp2_internal_data && data) {
+void http2_connection<session_type>::trace(ops state) {
     if (debug_on) {
         fmt::print("state={}\n", static_cast<int>(state));
     }
-    if constexpr (state == ops::on_frame_send) {
-        auto frame = std::get<const nghttp2_frame*>(data);
-        auto type = static_cast<nghttp2_frame_type>(frame->hd.type);
-        dump_frame(type, "<----------------------------");
+}
 
-        if (type != NGHTTP2_PUSH_PROMISE) {
-            if constexpr (session_type == session_t::client) {
-                if ((type == NGHTTP2_GOAWAY)) {
-                    _done = true;
-                }
+template<session_t session_type>
+int http2_connection<session_type>::on_frame_send(const nghttp2_frame *frame) {
+    trace(ops::on_frame_send);
+    auto type = static_cast<nghttp2_frame_type>(frame->hd.type);
+    dump_frame(type, "<----------------------------");
+    ++_stats.frames_sent;
+
+    if (type != NGHTTP2_PUSH_PROMISE) {
+        if constexpr (session_type == session_t::client) {
+            if ((type == NGHTTP2_GOAWAY)) {
+                _done = true;
+            }
+        } else {
+            if (type == NGHTTP2_GOAWAY && _flood_guard.tripped()) {
+                _done = true;
+            }
+        }
+        return 0;
+    }
+    // we can push response on stream 2 only after succesful push promise send
+    auto id = frame->push_promise.promised_stream_id;
+    auto promised_stream = find_stream(id);
+    if (!promised_stream || _done)
+        return 0;
+
+    promised_stream->set_in_flight(true);
+    with_gate(_handlers, [promised_stream, this] {
+        return promised_stream->eat_request(true).then([promised_stream, this](){
+            promised_stream->set_in_flight(false);
+            if (promised_stream->closed()) {
+                close_stream(promised_stream->get_id());
+                return make_ready_future<>();
+            }
+            promised_stream->commit_response();
+            auto rc = submit_response(*promised_stream);
+            if (rc != 0) {
+                reset_stream(promised_stream->get_id(), NGHTTP2_INTERNAL_ERROR);
+            }
+            return process_send();
+        });
+    });
+    return 0;
+}
+
+template<session_t session_type>
+void http2_connection<session_type>::handle_request(http2_stream *stream) {
+    if (stream->closed() || stream->in_flight()) {
+        return;
+    }
+    if (serve_from_cache(*stream)) {
+        return;
+    }
+    // now normal flow for stream 1 - commit response
+    auto started = steady_clock_type::now();
+    stream->set_in_flight(true);
+    with_gate(_handlers, [stream, started, this] {
+        return stream->eat_request().then([stream, started, this](){
+            stream->set_in_flight(false);
+            if (stream->closed()) {
+                // peer reset the stream while the handler was running
+                close_stream(stream->get_id());
+                return make_ready_future<>();
+            }
+            if constexpr (session_type == session_t::server) {
+                auto rtt = std::chrono::duration_cast<std::chrono::microseconds>(steady_clock_type::now() - started);
+                _limiter.on_sample(rtt, pending_streams());
+                update_streams_limit();
             }
-          return 0;
-        }
-        else
-        {
-            // we can push response on stream 2 only after succesful push promise send
-            auto id = frame->push_promise.promised_stream_id;
-            auto promised_stream = find_stream(id);
-            if (!promised_stream)
-                return 0;
-
-            promised_stream->eat_request(true).then([promised_stream, this](){
-                promised_stream->commit_response();
-                auto rc = submit_response(*promised_stream);
-                if (rc != 0) {
-                    reset_stream(promised_stream->get_id(), NGHTTP2_INTERNAL_ERROR);
+            if (stream->pushable()) {
+                // 1. stream 1 has req and some rep was deliverd by callback
+                // 2. simulate push reponse and get stream 2
+                stream->commit_response(true);
+                auto id = submit_push_promise(*stream);
+                if (id < 0) {
+                    throw nghttp2_exception("submit_push_promise", id);
                 }
-                return process_send();
-            });
+                stream->migrate_to_promise();
+                create_stream(id);
+                auto promised_strm = find_stream(id);
+                assert(promised_strm != nullptr);
+            }
+            stream->commit_response();
+            auto rc = submit_response(*stream);
+            if (rc != 0) {
+                reset_stream(stream->get_id(), NGHTTP2_INTERNAL_ERROR);
+            }
+            rc = resume(*stream);
+            if (!rc)
+                throw nghttp2_exception("resume", rc);
+            return process_send();
+        });
+    });
+}
+
+template<session_t session_type>
+bool http2_connection<session_type>::serve_from_cache(http2_stream &stream) {
+    // hits never reach the handler, the response is rebuilt from the shared cached buffers
+    auto &req = stream.get_request();
+    if (!_routes.cacheable(req)) {
+        return false;
+    }
+    auto &cache = _routes._response_cache;
+    auto key = response_cache::key(req, bool(_routes.gzip_threshold(req._path)));
+    auto rep = std::make_unique<response>();
+    auto state = cache.lookup(key, *rep);
+    if (state == response_cache::freshness::miss) {
+        return false;
+    }
+    if (state == response_cache::freshness::stale && !_done && cache.start_revalidation(key)) {
+        auto refresh_req = make_lw_shared<request>(req);
+        with_gate(_handlers, [this, key, refresh_req] {
+            return refresh_cached(key, refresh_req);
+        });
+    }
+    stream.set_response(std::move(rep));
+    stream.commit_response();
+    if (submit_response(stream) != 0) {
+        reset_stream(stream.get_id(), NGHTTP2_INTERNAL_ERROR);
+    }
+    return true;
+}
+
+template<session_t session_type>
+future<> http2_connection<session_type>::refresh_cached(sstring key, lw_shared_ptr<request> req) {
+    auto &cache = _routes._response_cache;
+    const auto &handler = _routes.handle(req->_path);
+    if (!handler) {
+        cache.end_revalidation(key);
+        return make_ready_future<>();
+    }
+    return handler(std::move(req), std::make_unique<response>()).then([this, key] (auto req_rep) {
+        auto &[req, rep] = req_rep;
+        http2_stream::compress_response(_routes, *req, *rep);
+        if (!_routes._response_cache.store(key, *rep)) {
+            _routes._response_cache.end_revalidation(key);
         }
-    } else if constexpr (state == ops::on_begin_headers) {
-        auto frame = std::get<const nghttp2_frame*>(data);
-        if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
-            return 0;
+    }).handle_exception([this, key] (std::exception_ptr) {
+        // keep serving the stale entry until it expires
+        _routes._response_cache.end_revalidation(key);
+    });
+}
+
+template<session_t session_type>
+int http2_connection<session_type>::on_send_data(const uint8_t *framehd, size_t length, nghttp2_data_source *source) {
+    // no padding callback is set, so the frame is just its 9 byte header and the payload
+    constexpr auto frame_header_size = 9u;
+    auto rep = reinterpret_cast<response*>(source->ptr);
+    _zero_copy_out = net::packet(std::move(_zero_copy_out),
+                                 temporary_buffer<char>(reinterpret_cast<const char*>(framehd), frame_header_size));
+    if (length != 0) {
+        _zero_copy_out = net::packet(std::move(_zero_copy_out), rep->take_body(length));
+    }
+    _zero_copy_writes = true;
+    return 0;
+}
+
+template<session_t session_type>
+int http2_connection<session_type>::on_begin_headers(const nghttp2_frame *frame) {
+    trace(ops::on_begin_headers);
+    if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
+        return 0;
+    }
+    // refused streams are never processed, so clients may retry them elsewhere
+    if (_routes._admission && _routes._admission->should_refuse()) {
+        reset_stream(frame->hd.stream_id, NGHTTP2_REFUSED_STREAM);
+        return 0;
+    }
+
+    create_stream(frame->hd.stream_id);
+    dump_frame(static_cast<nghttp2_frame_type>(frame->hd.type));
+    return 0;
+}
+
+template<session_t session_type>
+int http2_connection<session_type>::on_header(const nghttp2_frame *frame, const uint8_t *name, size_t namelen,
+                                              const uint8_t *value, size_t valuelen) {
+    // request creation, runs once per header so it is kept free of any marshalling
+    trace(ops::on_header);
+    if constexpr (session_type == session_t::client) {
+        if (frame->hd.type == NGHTTP2_HEADERS && _stream_observer.header) {
+            _stream_observer.header(frame->hd.stream_id, name, namelen, value, valuelen);
         }
+        return 0;
+    }
+    if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
+        return 0;
+    }
+    auto stream = find_stream(frame->hd.stream_id);
+    if (!stream)
+        return 0;
+    stream->update_request(name, namelen, value, valuelen);
+    return 0;
+}
 
-        create_stream(frame->hd.stream_id);
-        dump_frame(static_cast<nghttp2_frame_type>(frame->hd.type));
-    } else if constexpr (state == ops::on_header) {
-        // request creation
-        auto [frame, feed] = std::get<std::tuple<const nghttp2_frame*, request_feed>>(data);
-        if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
-            return 0;
+template<session_t session_type>
+int http2_connection<session_type>::on_data_chunk_recv(int32_t stream_id, const uint8_t *data, size_t len) {
+    trace(ops::on_data_chunk_recv);
+    if constexpr (session_type == session_t::client) {
+        eat_server_rep(stream_id, share_rx(data, len), false);
+    } else {
+        auto stream = find_stream(stream_id);
+        if (stream && !stream->closed() && !stream->update_request_body(share_rx(data, len), _routes._max_request_body)) {
+            // never handled, on_stream_close releases it
+            stream->mark_closed();
+            reset_stream(stream_id, NGHTTP2_CANCEL);
         }
-        auto stream = find_stream(frame->hd.stream_id);
-        if (!stream)
+    }
+    return 0;
+}
+
+template<session_t session_type>
+int http2_connection<session_type>::on_frame_recv(const nghttp2_frame *frame) {
+    // handling request + commiting response
+    trace(ops::on_frame_recv);
+    auto stream = find_stream(frame->hd.stream_id);
+    auto type = static_cast<nghttp2_frame_type>(frame->hd.type);
+    dump_frame(type);
+    ++_stats.frames_received;
+    if (type == NGHTTP2_RST_STREAM) {
+        ++_stats.resets_received;
+    } else if (type == NGHTTP2_GOAWAY) {
+        ++_stats.goaways_received;
+    }
+    if constexpr (session_type == session_t::server) {
+        if (detect_abuse(frame)) {
             return 0;
-        stream->update_request(feed);
-    } else if constexpr (state == ops::on_data_chunk_recv) {
-        if constexpr (session_type == session_t::client) {
-            eat_server_rep(std::get<data_chunk_feed>(data));
         }
+        if (stream && (frame->hd.flags & NGHTTP2_FLAG_END_STREAM)) {
+            stream->set_request_complete();
+        }
+    }
+    if (!stream || (type != NGHTTP2_HEADERS && type != NGHTTP2_DATA)) {
         return 0;
-    } else if constexpr (state == ops::on_frame_recv) {
-        // handling request + commiting response
-        auto frame = std::get<const nghttp2_frame*>(data);
-        auto stream = find_stream(frame->hd.stream_id);
-        auto type = static_cast<nghttp2_frame_type>(frame->hd.type);
-        dump_frame(type);
-
-        switch (type) {
-        case NGHTTP2_DATA: {
-            if constexpr (session_type == session_t::client)
-                break;
-            if (!stream)
-                break;
-            if (frame->hd.flags & NGHTTP2_FLAG_END_STREAM) {
-                return error();
-            }
-            break;
+    }
+    auto end_stream = frame->hd.flags & NGHTTP2_FLAG_END_STREAM;
+    if constexpr (session_type == session_t::server) {
+        // the request is handled once it is complete, its body included
+        if (end_stream) {
+            stream->finish_request_body();
+            handle_request(stream);
         }
-        case NGHTTP2_HEADERS: {
-            if (!stream || frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
-                break;
-            }
-            // now normal flow for stream 1 - commit response
-            stream->eat_request().then([stream, this](){
-                if (stream->pushable()) {
-                    // 1. stream 1 has req and some rep was deliverd by callback
-                    // 2. simulate push reponse and get stream 2
-                    stream->commit_response(true);
-                    auto id = submit_push_promise(*stream);
-                    if (id < 0) {
-                        throw nghttp2_exception("submit_push_promise", id);
-                    }
-                    stream->migrate_to_promise();
-                    create_stream(id);
-                    auto promised_strm = find_stream(id);
-                    assert(promised_strm != nullptr);
-                }
-                stream->commit_response();
-                auto rc = submit_response(*stream);
-                if (rc != 0) {
-                    reset_stream(stream->get_id(), NGHTTP2_INTERNAL_ERROR);
-                }
-                rc = resume(*stream);
-                if (!rc)
-                    throw nghttp2_exception("resume", rc);
-                return process_send();
-            });
-            break;
+    } else {
+        if (type == NGHTTP2_HEADERS && frame->headers.cat == NGHTTP2_HCAT_RESPONSE && _stream_observer.headers) {
+            _stream_observer.headers(frame->hd.stream_id);
         }
-        default:
-            break;
+        if (end_stream) {
+            eat_server_rep(frame->hd.stream_id, temporary_buffer<char>(), true);
         }
-    } else if constexpr (state == ops::on_frame_not_send) {
-    } else if constexpr (state == ops::on_stream_close) {
-        auto stream_id = std::get<int32_t>(data);
-        auto stream = find_stream(stream_id);
-        if (!stream)
+    }
+    return 0;
+}
+
+template<session_t session_type>
+int http2_connection<session_type>::on_stream_close(int32_t stream_id, uint32_t error_code) {
+    trace(ops::on_stream_close);
+    auto stream = find_stream(stream_id);
+    if (!stream)
+        return 0;
+    if constexpr (session_type == session_t::server) {
+        // odd ids are client initiated, pushed streams never see the peer's END_STREAM
+        if ((stream_id % 2) == 1 && !stream->request_complete()) {
+            note_abuse(abuse::header_only_stream);
+        }
+        if (stream->in_flight()) {
+            // the handler continuation still refers to it, let it release the stream
+            stream->mark_closed();
             return 0;
-        close_stream(stream_id);
-        if constexpr (session_type == session_t::client) {
-            if (pending_streams() > 0) {
-                auto rc = handle_remaining_reqs();
-                if (rc <= 0) {
-                    return error();
-                }
+        }
+    }
+    close_stream(stream_id);
+    if constexpr (session_type == session_t::client) {
+        if (_stream_observer.closed) {
+            _stream_observer.closed(stream_id, error_code);
+        }
+        if (pending_streams() > 0) {
+            auto rc = handle_remaining_reqs();
+            if (rc <= 0) {
+                return error();
             }
-            if (_remaining_reqs.empty() && (pending_streams() == 0)) {
-                auto rc = nghttp2_session_terminate_session(_session, NGHTTP2_NO_ERROR);
-                if (rc != 0) {
-                    return error();
-                }
+        }
+        if (!_keep_open && _remaining_reqs.empty() && (pending_streams() == 0)) {
+            auto rc = nghttp2_session_terminate_session(_session, NGHTTP2_NO_ERROR);
+            if (rc != 0) {
+                return error();
             }
         }
-    } else {
-        return error();
     }
     return 0;
 }
@@ -543,7 +1045,11 @@ void http2_connection<session_type>::create_stream(const int32_t stream_id) {
 
 template<session_t session_type>
 void http2_connection<session_type>::close_stream(const int32_t stream_id) {
+    if (last_active_stream.first == stream_id) {
+        last_active_stream = {-1, nullptr};
+    }
     _streams.erase(stream_id);
+    arm_idle_timer();
 }
 
 template<session_t session_type>
@@ -558,11 +1064,13 @@ http2_stream *http2_connection<session_type>::find_stream(const int32_t stream_i
     return (*it).second.get();
 }
 
-user_callback routes::handle(const sstring &path) {
-    return _path_to_handler[path];
+const user_callback &routes::handle(const sstring &path) const {
+    // find() rather than operator[], every file path served would leave an entry behind
+    auto it = _path_to_handler.find(path);
+    return (it != _path_to_handler.end())? it->second : _no_handler;
 }
 
-user_callback routes::handle_push() {
+const user_callback &routes::handle_push() const {
      return _push_handler;
 }
 
@@ -570,6 +1078,21 @@ routes& routes::add(const method type, const sstring &path, user_callback handle
     _path_to_handler[path] = handler;
     return *this;
 }
+routes& routes::compress(const sstring &path, size_t min_size) {
+    _gzip_thresholds[path] = min_size;
+    return *this;
+}
+routes& routes::cache(const sstring &path) {
+    _cacheable.insert(path);
+    return *this;
+}
+std::optional<size_t> routes::gzip_threshold(const sstring &path) const {
+    if (_gzip_thresholds.empty()) {
+        return std::nullopt;
+    }
+    auto it = _gzip_thresholds.find(path);
+    return (it != _gzip_thresholds.end())? std::optional<size_t>(it->second) : std::nullopt;
+}
 
 routes &routes::add_on_push(const sstring &path, user_callback handler, user_callback push_handler) {
     _push_path = path;
@@ -23,11 +23,22 @@
 #pragma once
 
 #include "http2_file_handler.hh"
+#include "http2_admission.hh"
+#include "http2_flood_guard.hh"
+#include "http2_memory.hh"
+#include "http2_compression.hh"
+#include "http2_response_cache.hh"
+#include "http2_single_flight.hh"
 #include "http2_request_response.hh"
 #include "core/iostream.hh"
 #include "http/routes.hh"
 #include "net/api.hh"
+#include "net/packet.hh"
 #include "core/future-util.hh"
+#include "core/gate.hh"
+#include "core/semaphore.hh"
+#include "core/timer.hh"
+#include "core/lowres_clock.hh"
 #include "core/temporary_buffer.hh"
 #include "core/sstring.hh"
 #include "core/iostream.hh"
@@ -38,10 +49,13 @@
 #include "net/tls.hh"
 #include <nghttp2/nghttp2.h>
 #include <boost/intrusive/list.hpp>
+#include <algorithm>
 #include <optional>
 #include <memory>
 #include <tuple>
+#include <utility>
 #include <unordered_map>
+#include <unordered_set>
 #include <array>
 #include <vector>
 #include <stdexcept>
@@ -67,34 +81,68 @@ using user_callback = std::function<
                             std::tuple<
                                 lw_shared_ptr<request>, std::unique_ptr<response>>>
     (lw_shared_ptr<request>, std::unique_ptr<response>)>;
-using client_callback = std::function<void(const sstring&)>;
+// body chunks of responses as they arrive, sharing the connection's read buffer;
+// the end of every response is reported once, with an empty chunk
+using client_callback = std::function<void(int32_t stream_id, temporary_buffer<char> chunk, bool end_of_stream)>;
 
 using dhandler = seastar::httpd2::directory_handler;
 
 class routes {
 public:
-    user_callback handle(const sstring &path);
-    user_callback handle_push();
+    const user_callback &handle(const sstring &path) const;
+    const user_callback &handle_push() const;
     routes& add(const method type, const sstring &path, user_callback handler);
     routes& add_on_push(const sstring &path, user_callback handler, user_callback push_handler);
     routes& add_on_client(client_callback handler);
     sstring& get_push_path() { return _push_path; }
     routes& add_directory_handler(dhandler *handler);
+    // gzip bodies of at least min_size bytes returned by the handler of path,
+    // for clients that accept it
+    routes& compress(const sstring &path, size_t min_size = 1024);
+    std::optional<size_t> gzip_threshold(const sstring &path) const;
+    // keep responses of path in the response cache, for as long as their
+    // cache-control allows
+    routes& cache(const sstring &path);
+    bool cacheable(const sstring &path) const {
+        return !_cacheable.empty() && _cacheable.count(path);
+    }
+    // only GET and HEAD are answered from the cache, other methods always reach the handler
+    bool cacheable(const request &req) const {
+        return (req._method == "GET" || req._method == "HEAD") && cacheable(req._path);
+    }
     ~routes() {
         delete _directory_handler;
     }
 private:
     std::unordered_map<sstring, user_callback> _path_to_handler;
+    std::unordered_map<sstring, size_t> _gzip_thresholds;
+    std::unordered_set<sstring> _cacheable;
     user_callback _push_handler;
+    user_callback _no_handler;
     sstring _push_path;
 public:
     dhandler *_directory_handler {nullptr};
     sstring *_date {nullptr};
+    admission_controller *_admission {nullptr};
+    flood_stats *_flood_stats {nullptr};
+    // per connection limit of nghttp2 session memory, 0 means unlimited
+    size_t _session_memory_budget {0};
+    // larger request bodies get the stream cancelled
+    size_t _max_request_body {1 << 20};
+    compression_cache _compression_cache;
+    response_cache _response_cache;
+    // identical concurrent GETs of cacheable routes and files share one response
+    single_flight _single_flight;
+    // idle server connections drop their per-stream state after this long, 0 disables
+    lowres_clock::duration _idle_compact_after {10s};
+    // client sessions leave WINDOW_UPDATEs to whoever reads the response
+    // bodies, through http2_connection::consume()
+    bool _manual_window_update {false};
 public:
     client_callback _client_handler;
 };
 
-class http2_stream {
+class http2_stream : public pooled<http2_stream> {
 public:
     http2_stream() = default;
     http2_stream(const int32_t id, routes &routes_)
@@ -111,8 +159,40 @@ public:
     bool pushable() const {
         return _req->_path == _routes.get_push_path();
     }
-    void update_request(request_feed &data) {
-        _req->add_header(data);
+    void update_request(const uint8_t *name, size_t namelen, const uint8_t *value, size_t valuelen) {
+        _req->add_header(name, namelen, value, valuelen);
+    }
+    // false once the body would grow past max_size, chunk shares the read buffer
+    bool update_request_body(temporary_buffer<char> chunk, size_t max_size) {
+        if (_request_body_size + chunk.size() > max_size) {
+            return false;
+        }
+        _request_body_size += chunk.size();
+        _request_body.push_back(std::move(chunk));
+        return true;
+    }
+    // at END_STREAM, the chunks are copied into the request in one go
+    void finish_request_body() {
+        if (_request_body.empty()) {
+            return;
+        }
+        sstring body(sstring::initialized_later(), _request_body_size);
+        auto out = body.begin();
+        for (const auto &chunk : _request_body) {
+            out = std::copy_n(chunk.get(), chunk.size(), out);
+        }
+        _req->_body = std::move(body);
+        _request_body.clear();
+    }
+    // client side, copies the next part of the request body into a DATA frame
+    ssize_t read_request_body(uint8_t *buf, size_t length, uint32_t *flags) {
+        auto size = std::min(length, _req->_body.size() - _request_body_sent);
+        std::copy_n(_req->_body.data() + _request_body_sent, size, buf);
+        _request_body_sent += size;
+        if (_request_body_sent == _req->_body.size()) {
+            *flags |= NGHTTP2_DATA_FLAG_EOF;
+        }
+        return size;
     }
     void commit_response(bool promised = false);
     void migrate_to_promise() {
@@ -122,28 +202,85 @@ public:
     const response &get_response() const {
         return *_rep;
     }
+    const request &get_request() const {
+        return *_req;
+    }
+    void set_response(std::unique_ptr<response> rep) {
+        _rep = std::move(rep);
+    }
+    static void compress_response(routes &routes_, const request &req, response &rep);
+    bool request_complete() const {
+        return _request_complete;
+    }
+    void set_request_complete() {
+        _request_complete = true;
+    }
+    bool in_flight() const {
+        return _in_flight;
+    }
+    void set_in_flight(bool in_flight) {
+        _in_flight = in_flight;
+    }
+    bool closed() const {
+        return _closed;
+    }
+    void mark_closed() {
+        _closed = true;
+    }
 private:
+    future<> run_handler(bool promised_stream);
+    // key of the in-flight table, empty when the request must run on its own
+    std::optional<sstring> flight_key() const;
+
     int32_t _id {0};
+    bool _request_complete {false};
+    bool _in_flight {false};
+    bool _closed {false};
+    size_t _request_body_sent {0};
+    // server side, DATA received so far
+    std::vector<temporary_buffer<char>> _request_body;
+    size_t _request_body_size {0};
     lw_shared_ptr<request> _req;
     std::unique_ptr<response> _rep, _promised_rep;
     routes &_routes;
 };
 
 enum class session_t {client, server};
+// only used to trace callbacks in debug output
 enum class ops {
     on_begin_headers,
     on_frame_recv,
     on_header,
     on_data_chunk_recv,
     on_stream_close,
-    on_frame_send,
-    on_frame_not_send
+    on_frame_send
 };
 
 namespace legacy = seastar::httpd;
 
+class http2_connection_tester;
+
+// what a connection exchanged with its peer, frames of all types included
+struct connection_stats {
+    uint64_t bytes_sent {0};
+    uint64_t bytes_received {0};
+    uint64_t frames_sent {0};
+    uint64_t frames_received {0};
+    uint64_t resets_received {0};
+    uint64_t goaways_received {0};
+
+    void merge(const connection_stats &other) {
+        bytes_sent += other.bytes_sent;
+        bytes_received += other.bytes_received;
+        frames_sent += other.frames_sent;
+        frames_received += other.frames_received;
+        resets_received += other.resets_received;
+        goaways_received += other.goaways_received;
+    }
+};
+
 template<session_t session_type = session_t::server>
-class http2_connection final : public legacy::session {
+class http2_connection final : public legacy::session, public pooled<http2_connection<session_type>, 1024> {
 public:
     explicit http2_connection(routes &routes_, connected_socket&& fd, socket_address addr = socket_address());
     future<> process() override;
@@ -156,11 +293,51 @@ public:
     int submit_push_promise(http2_stream &stream);
     int submit_request(lw_shared_ptr<request> _request);
     void create_stream(const int32_t stream_id, lw_shared_ptr<request> req);
-    void eat_server_rep(data_chunk_feed data);
+    void eat_server_rep(int32_t stream_id, temporary_buffer<char> chunk, bool end_of_stream);
     unsigned pending_streams() const {
         return _streams.size();
     }
+    size_t session_memory_usage() const {
+        return _session_memory.used();
+    }
+    bool compacted() const {
+        return _compacted;
+    }
+    const connection_stats &stats() const {
+        return _stats;
+    }
+    // client side: whether another request can start a stream right away
+    bool can_submit() const {
+        return pending_streams() < streams_limit();
+    }
+    // client side: per stream events of responses, all of them optional
+    struct stream_observer {
+        // the first HEADERS frame of the response arrived
+        std::function<void(int32_t)> headers;
+        // the stream is gone, error_code is NGHTTP2_NO_ERROR unless it was reset
+        std::function<void(int32_t, uint32_t error_code)> closed;
+        // every header of the response, :status included
+        std::function<void(int32_t, const uint8_t *name, size_t namelen, const uint8_t *value, size_t valuelen)> header;
+        // body chunks as for client_callback, instead of the routes' client handler
+        client_callback data;
+    };
+    void observe_streams(stream_observer observer) {
+        _stream_observer = std::move(observer);
+    }
+    // client side: keeps the session up while no request is pending, for clients
+    // that submit requests over time instead of all at once
+    void keep_open(bool keep) {
+        _keep_open = keep;
+    }
+    // client side, with routes::_manual_window_update: len bytes of stream_id's
+    // body were read, the server may send that much more once frames go out
+    void consume(int32_t stream_id, size_t len);
+    // client side: sends requests submitted outside of the receive loop
+    future<> send_requests();
+    // client side: ends the session once the pending requests are answered
+    future<> finish();
 private:
+    session_memory _session_memory;
     nghttp2_session *_session {nullptr};
     bool _done {false};
     std::unordered_map<int32_t, std::unique_ptr<http2_stream>> _streams;
@@ -170,22 +347,107 @@ private:
     output_stream<char> _write_buf;
     routes &_routes;
     constexpr static auto _streams_limit = 100u;
+    // client side: ours, or lower if the server's SETTINGS asked for it
+    uint32_t streams_limit() const {
+        return std::min<uint32_t>(_streams_limit,
+            nghttp2_session_get_remote_settings(_session, NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS));
+    }
+    uint32_t _advertised_streams_limit {_streams_limit};
+    concurrency_limiter _limiter;
+    flood_guard _flood_guard;
+    gate _handlers;
+    timer<lowres_clock> _idle_timer;
+    bool _compacted {false};
+    // set once a DATA frame was sent without copying, output_stream can't mix
+    // buffered and zero-copy writes so from then on all frames go out as packets
+    bool _zero_copy_writes {false};
+    net::packet _zero_copy_out;
     std::vector<lw_shared_ptr<request>> _remaining_reqs;
+    stream_observer _stream_observer;
+    // buffer being parsed by nghttp2, DATA payloads point into it
+    temporary_buffer<char> *_rx_buf {nullptr};
+    // the receive loop, handlers and clients all send, output_stream takes one writer at a time
+    semaphore _send_lock {1};
+    bool _keep_open {false};
+    connection_stats _stats;
     bool _start_with_reading;
 
+    static nghttp2_session_callbacks *callbacks();
+    static void set_callbacks(nghttp2_session_callbacks *callbacks);
     future<> process_send();
+    future<> send_pending();
     int submit_request_nghttp2(lw_shared_ptr<request> _request);
     void reset_stream(int32_t stream_id, uint32_t error_code);
+    void update_streams_limit();
+    bool detect_abuse(const nghttp2_frame *frame);
+    bool note_abuse(abuse kind);
+    void handle_request(http2_stream *stream);
+    bool serve_from_cache(http2_stream &stream);
+    future<> refresh_cached(sstring key, lw_shared_ptr<request> req);
+    void submit_header_table_size(uint32_t size);
+    void arm_idle_timer();
+    void compact();
+    void rehydrate();
     future<> internal_process();
     void dump_frame(nghttp2_frame_type frame_type, const char *direction = "---------------------------->");
     void receive_nghttp2(const uint8_t *data, size_t len);
     int send_nghttp2(const uint8_t **data);
+    temporary_buffer<char> share_rx(const uint8_t *data, size_t len);
     int handle_remaining_reqs();
-    template<ops state>
-    int consume_frame(nghttp2_internal_data &&data);
+    void trace(ops state);
+    int on_begin_headers(const nghttp2_frame *frame);
+    int on_header(const nghttp2_frame *frame, const uint8_t *name, size_t namelen,
+                  const uint8_t *value, size_t valuelen);
+    int on_frame_recv(const nghttp2_frame *frame);
+    int on_data_chunk_recv(int32_t stream_id, const uint8_t *data, size_t len);
+    int on_stream_close(int32_t stream_id, uint32_t error_code = NGHTTP2_NO_ERROR);
+    int on_frame_send(const nghttp2_frame *frame);
+    int on_send_data(const uint8_t *framehd, size_t length, nghttp2_data_source *source);
     void create_stream(const int32_t stream_id);
     void close_stream(const int32_t stream_id);
     http2_stream *find_stream(const int32_t stream_id);
+    friend class http2_connection_tester;
+};
+
+class http2_connection_tester {
+public:
+    template<session_t session_type>
+    static int on_begin_headers(http2_connection<session_type> &conn, const nghttp2_frame *frame) {
+        return conn.on_begin_headers(frame);
+    }
+    template<session_t session_type>
+    static int on_header(http2_connection<session_type> &conn, const nghttp2_frame *frame, const uint8_t *name,
+                         size_t namelen, const uint8_t *value, size_t valuelen) {
+        return conn.on_header(frame, name, namelen, value, valuelen);
+    }
+    // what the idle timer does, compact and send the SETTINGS frame it queued
+    template<session_t session_type>
+    static future<> compact(http2_connection<session_type> &conn) {
+        conn.compact();
+        return conn.process_send();
+    }
+    template<session_t session_type>
+    static http2_stream *find_stream(http2_connection<session_type> &conn, const int32_t stream_id) {
+        return conn.find_stream(stream_id);
+    }
+    // a DATA payload lying in rx, as the connection hands it to body consumers
+    template<session_t session_type>
+    static temporary_buffer<char> share_rx(http2_connection<session_type> &conn, temporary_buffer<char> &rx,
+                                           const char *data, size_t len) {
+        conn._rx_buf = &rx;
+        auto chunk = conn.share_rx(reinterpret_cast<const uint8_t*>(data), len);
+        conn._rx_buf = nullptr;
+        return chunk;
+    }
+    // the shard's cached table, and filling a new one as every connection once did
+    template<session_t session_type>
+    static nghttp2_session_callbacks *callbacks() {
+        return http2_connection<session_type>::callbacks();
+    }
+    template<session_t session_type>
+    static void set_callbacks(nghttp2_session_callbacks *callbacks) {
+        http2_connection<session_type>::set_callbacks(callbacks);
+    }
 };
 
 }
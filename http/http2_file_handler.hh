@@ -29,6 +29,14 @@
 #include "core/app-template.hh"
 #include "exception.hh"
 #include "http2_request_response.hh"
+#include "http2_compression.hh"
+#include "http2_static_bundle.hh"
+#include <array>
+#include <chrono>
+#include <ctime>
+#include <limits>
+#include <optional>
+#include <string_view>
 
 namespace seastar {
 
@@ -36,21 +44,289 @@ namespace httpd2 {
 
 class directory_handler {
 public:
-    explicit directory_handler(const sstring& doc_root)
-            :  doc_root(doc_root) {
+    // with zero_copy the file is kept in the buffers it was read into and each
+    // DATA frame is sent from them directly, instead of being copied into the body
+    explicit directory_handler(const sstring& doc_root, bool zero_copy = false)
+            :  doc_root(doc_root), _zero_copy(zero_copy) {
     }
 
     future<std::unique_ptr<response>> handle(lw_shared_ptr<request> req, std::unique_ptr<response> rep) {
+        if (_bundle && req->_range.empty()) {
+            if (auto asset = _bundle->find(req->_path)) {
+                return make_ready_future<std::unique_ptr<response>>(serve_asset(*asset, *req, std::move(rep)));
+            }
+        }
         sstring full_path = doc_root + req->_path;
         auto h = this;
-        return engine().file_type(full_path).then(
-                [h, full_path, req = std::move(req), rep = std::move(rep)](auto val) mutable {
-                    if (val) {
-                        return h->read(full_path, std::move(req), std::move(rep));
-                    }
-                    rep->set_status(404u);
-                    return make_ready_future<std::unique_ptr<response>>(std::move(rep));
-                });
+        return find_encoded_variant(full_path, req->_accept_encoding).then(
+                [h, full_path, req = std::move(req), rep = std::move(rep)](variant_choice choice) mutable {
+            auto path = full_path;
+            // the identity response too, or a shared cache could hand it to clients that get the encoded one
+            if (choice.has_siblings) {
+                rep->add_header("vary", "accept-encoding");
+            }
+            if (choice.variant >= 0) {
+                auto &encoded = encoded_variants[choice.variant];
+                rep->add_header("content-encoding", encoded.coding);
+                path += encoded.suffix;
+            }
+            // validators come from the metadata alone, so revalidation never opens the file
+            return engine().file_stat(path).then_wrapped(
+                    [h, path, req = std::move(req), rep = std::move(rep)](future<stat_data> f) mutable {
+                        stat_data st;
+                        try {
+                            st = f.get0();
+                        } catch (...) {
+                            rep->set_status(404u);
+                            return make_ready_future<std::unique_ptr<response>>(std::move(rep));
+                        }
+                        if (st.type != directory_entry_type::regular) {
+                            rep->set_status(404u);
+                            return make_ready_future<std::unique_ptr<response>>(std::move(rep));
+                        }
+                        auto etag = make_etag(st);
+                        rep->add_header("etag", etag);
+                        rep->add_header("last-modified", to_http_date(st.time_modified));
+                        if (not_modified(*req, etag, st.time_modified)) {
+                            rep->set_status(304u);
+                            rep->_header_only = true;
+                            return make_ready_future<std::unique_ptr<response>>(std::move(rep));
+                        }
+                        rep->add_header("accept-ranges", "bytes");
+                        if (req->_method == "HEAD") {
+                            rep->_header_only = true;
+                            rep->_content_length = st.size;
+                            return make_ready_future<std::unique_ptr<response>>(std::move(rep));
+                        }
+                        if (!req->_range.empty() && range_applies(*req, etag, st.time_modified)) {
+                            auto ranges = parse_range(req->_range, st.size);
+                            if (ranges && ranges->empty()) {
+                                rep->set_status(416u);
+                                rep->add_header("content-range", "bytes */" + to_sstring(st.size));
+                                return make_ready_future<std::unique_ptr<response>>(std::move(rep));
+                            }
+                            if (ranges) {
+                                return h->read_ranges(path, std::move(*ranges), st.size, std::move(rep));
+                            }
+                        }
+                        return h->read(path, std::move(req), std::move(rep));
+                    });
+        });
+    }
+
+    // strong validator, changes whenever the file is replaced or rewritten
+    static sstring make_etag(const stat_data& st) {
+        auto mtime = std::chrono::duration_cast<std::chrono::nanoseconds>(st.time_modified.time_since_epoch()).count();
+        return sprint("\"%x-%x-%x\"", st.inode_number, st.size, mtime);
+    }
+
+    static bool etag_matches(const sstring& if_none_match, const sstring& etag) {
+        // weak comparison, W/ prefixes are ignored
+        auto opaque = [] (std::string_view tag) {
+            auto begin = tag.find_first_not_of(" \t");
+            auto end = tag.find_last_not_of(" \t");
+            tag = (begin == std::string_view::npos)? std::string_view() : tag.substr(begin, end - begin + 1);
+            return (tag.substr(0, 2) == "W/")? tag.substr(2) : tag;
+        };
+        std::string_view list(if_none_match.data(), if_none_match.size());
+        std::string_view ours(etag.data(), etag.size());
+        while (!list.empty()) {
+            auto comma = list.find(',');
+            auto tag = opaque(list.substr(0, comma));
+            if (tag == "*" || tag == ours) {
+                return true;
+            }
+            list = (comma == std::string_view::npos)? std::string_view() : list.substr(comma + 1);
+        }
+        return false;
+    }
+
+    // inclusive, as in the content-range header
+    struct byte_range {
+        uint64_t first;
+        uint64_t last;
+    };
+    // more ranges than that in one request are more likely abuse than seeking
+    static constexpr size_t max_ranges = 16;
+
+    // Ranges of a "bytes=" range header clipped to the file size. nullopt when
+    // the header is malformed or asks for too many ranges, which means serving
+    // the whole file. An empty vector when none of the ranges is satisfiable.
+    static std::optional<std::vector<byte_range>> parse_range(const sstring& range, uint64_t size) {
+        std::string_view spec(range.data(), range.size());
+        if (spec.substr(0, 6) != "bytes=") {
+            return std::nullopt;
+        }
+        spec.remove_prefix(6);
+        auto number = [] (std::string_view s, uint64_t& value) {
+            auto begin = s.find_first_not_of(" \t");
+            auto end = s.find_last_not_of(" \t");
+            if (begin == std::string_view::npos) {
+                return false;
+            }
+            s = s.substr(begin, end - begin + 1);
+            value = 0;
+            for (auto c : s) {
+                if (c < '0' || c > '9' || value > (std::numeric_limits<uint64_t>::max() - 9) / 10) {
+                    return false;
+                }
+                value = value * 10 + (c - '0');
+            }
+            return true;
+        };
+        std::vector<byte_range> ranges;
+        auto specs = 0u;
+        while (!spec.empty()) {
+            auto comma = spec.find(',');
+            auto item = spec.substr(0, comma);
+            spec = (comma == std::string_view::npos)? std::string_view() : spec.substr(comma + 1);
+            if (++specs > max_ranges) {
+                return std::nullopt;
+            }
+            auto dash = item.find('-');
+            if (dash == std::string_view::npos) {
+                return std::nullopt;
+            }
+            uint64_t first, last;
+            if (item.substr(0, dash).find_first_not_of(" \t") == std::string_view::npos) {
+                // suffix range, the last n bytes
+                if (!number(item.substr(dash + 1), last)) {
+                    return std::nullopt;
+                }
+                if (last > 0 && size > 0) {
+                    ranges.push_back({size - std::min(last, size), size - 1});
+                }
+                continue;
+            }
+            if (!number(item.substr(0, dash), first)) {
+                return std::nullopt;
+            }
+            auto tail = item.substr(dash + 1);
+            if (tail.find_first_not_of(" \t") == std::string_view::npos) {
+                last = std::numeric_limits<uint64_t>::max();
+            } else if (!number(tail, last) || last < first) {
+                return std::nullopt;
+            }
+            if (first < size) {
+                ranges.push_back({first, std::min(last, size - 1)});
+            }
+        }
+        if (specs == 0) {
+            return std::nullopt;
+        }
+        return ranges;
+    }
+
+    static sstring content_range(const byte_range& range, uint64_t size) {
+        return sprint("bytes %d-%d/%d", range.first, range.last, size);
+    }
+
+    // if-range makes the range conditional on the representation being unchanged
+    static bool range_applies(const request& req, const sstring& etag, std::chrono::system_clock::time_point mtime) {
+        if (req._if_range.empty()) {
+            return true;
+        }
+        if (req._if_range == etag) {
+            return true;
+        }
+        auto date = parse_http_date(req._if_range);
+        return date && std::chrono::time_point_cast<std::chrono::seconds>(mtime) == *date;
+    }
+
+    static bool not_modified(const request& req, const sstring& etag, std::chrono::system_clock::time_point mtime) {
+        // if-modified-since is ignored when if-none-match is present (RFC 7232, 6)
+        if (!req._if_none_match.empty()) {
+            return etag_matches(req._if_none_match, etag);
+        }
+        if (!req._if_modified_since.empty()) {
+            auto since = parse_http_date(req._if_modified_since);
+            return since && std::chrono::time_point_cast<std::chrono::seconds>(mtime) <= *since;
+        }
+        return false;
+    }
+
+    // Loads the doc root into memory, files found there are then served without
+    // any I/O. Can be called again to pick up changes, resolves to false when the
+    // content hash shows nothing changed and the current bundle was kept.
+    future<bool> preload(size_t max_bytes = 64 << 20) {
+        return static_bundle::load(doc_root, max_bytes).then([this] (lw_shared_ptr<static_bundle> bundle) {
+            if (_bundle && _bundle->hash() == bundle->hash()) {
+                return false;
+            }
+            _bundle = std::move(bundle);
+            return true;
+        });
+    }
+
+    const lw_shared_ptr<static_bundle>& bundle() const {
+        return _bundle;
+    }
+
+    static std::unique_ptr<response> serve_asset(static_asset& asset, const request& req, std::unique_ptr<response> rep) {
+        auto gzip = !asset.gzip_body.empty() && accepts_encoding(req._accept_encoding, "gzip");
+        auto &etag = gzip? asset.gzip_etag : asset.etag;
+        rep->add_header("etag", etag);
+        rep->add_header("last-modified", asset.last_modified);
+        if (!asset.gzip_body.empty()) {
+            rep->add_header("vary", "accept-encoding");
+        }
+        if (not_modified(req, etag, asset.mtime)) {
+            rep->set_status(304u);
+            rep->_header_only = true;
+            return rep;
+        }
+        if (gzip) {
+            rep->add_header("content-encoding", "gzip");
+        }
+        if (req._method == "HEAD") {
+            rep->_header_only = true;
+            rep->_content_length = gzip? chunks_size(asset.gzip_body) : asset.body.size();
+            return rep;
+        }
+        if (gzip) {
+            for (auto &chunk : asset.gzip_body) {
+                rep->_body_chunks.push_back(chunk.share());
+            }
+        } else if (!asset.body.empty()) {
+            rep->_body_chunks.push_back(asset.body.share());
+        }
+        return rep;
+    }
+
+    struct encoded_variant {
+        const char *coding;
+        const char *suffix;
+    };
+    // precompressed siblings, in order of preference
+    static constexpr std::array<encoded_variant, 2> encoded_variants {{{"br", ".br"}, {"gzip", ".gz"}}};
+
+    struct variant_choice {
+        // index of the first existing sibling the client accepts, -1 if none
+        int variant {-1};
+        // any sibling exists, so the response depends on accept-encoding
+        bool has_siblings {false};
+    };
+
+    future<variant_choice> find_encoded_variant(sstring full_path, sstring accept_encoding,
+                                                unsigned variant = 0, bool has_siblings = false) {
+        if (variant == encoded_variants.size()) {
+            return make_ready_future<variant_choice>(variant_choice{-1, has_siblings});
+        }
+        auto acceptable = accepts_encoding(accept_encoding, encoded_variants[variant].coding);
+        if (has_siblings && !acceptable) {
+            // nothing to learn from this one
+            return find_encoded_variant(std::move(full_path), std::move(accept_encoding), variant + 1, true);
+        }
+        return engine().file_type(full_path + encoded_variants[variant].suffix).then(
+                [this, full_path, accept_encoding, variant, acceptable, has_siblings](auto val) mutable {
+            if (val && *val == directory_entry_type::regular) {
+                if (acceptable) {
+                    return make_ready_future<variant_choice>(variant_choice{int(variant), true});
+                }
+                has_siblings = true;
+            }
+            return find_encoded_variant(std::move(full_path), std::move(accept_encoding), variant + 1, has_siblings);
+        });
     }
 
     sstring get_extension(const sstring& file) {
@@ -71,18 +347,38 @@ public:
 
     struct reader {
     public:
-        reader(file f, std::unique_ptr<response> rep)
-                : is(make_file_input_stream(std::move(f)))
-                , _rep(std::move(rep)) {
+        reader(file f, std::unique_ptr<response> rep, bool zero_copy)
+                : is(make_file_input_stream(std::move(f), stream_options(zero_copy)))
+                , _rep(std::move(rep))
+                , _zero_copy(zero_copy) {
+        }
+        reader(input_stream<char> in, std::unique_ptr<response> rep, bool zero_copy)
+                : is(std::move(in))
+                , _rep(std::move(rep))
+                , _zero_copy(zero_copy) {
         }
         input_stream<char> is;
         std::unique_ptr<response> _rep;
+        bool _zero_copy;
+
+        static file_input_stream_options stream_options(bool zero_copy) {
+            file_input_stream_options options;
+            if (zero_copy) {
+                // one read buffer per maximum sized DATA frame
+                options.buffer_size = 16384;
+                options.read_ahead = 4;
+            }
+            return options;
+        }
 
         // for input_stream::consume():
         using unconsumed_remainder = std::experimental::optional<temporary_buffer<char>>;
         future<unconsumed_remainder> operator()(temporary_buffer<char> data) {
             if (data.empty()) {
                 return make_ready_future<unconsumed_remainder>(std::move(data));
+            } else if (_zero_copy) {
+                _rep->_body_chunks.push_back(std::move(data));
+                return make_ready_future<unconsumed_remainder>();
             } else {
                 _rep->_body.append(data.get(), data.size());
                 return make_ready_future<unconsumed_remainder>();
@@ -101,15 +397,75 @@ public:
             if (true) {
                 std::cout << "opened " << file_name << "\n";
             }
-            std::shared_ptr<reader> r = std::make_shared<reader>(std::move(f), std::move(rep));
-            return r->is.consume(*r).then([r, extension, this, req = std::move(req)]() {
+            std::shared_ptr<reader> r = std::make_shared<reader>(f, std::move(rep), _zero_copy);
+            return r->is.consume(*r).finally([r, f] () mutable {
+                // closing the stream leaves the file open
+                return r->is.close().finally([f] () mutable {
+                    return f.close();
+                });
+            }).then([r, extension, this, req = std::move(req)]() {
                 return make_ready_future<std::unique_ptr<response>>(std::move(r->_rep));
             });
         });
     }
 
+    // 206 with the requested ranges, as multipart/byteranges when there are several of them
+    future<std::unique_ptr<response>> read_ranges(
+            sstring file_name,
+            std::vector<byte_range> ranges,
+            uint64_t size,
+            std::unique_ptr<response> rep) {
+        return open_file_dma(file_name, open_flags::ro).then(
+                    [this, ranges = std::move(ranges), size, rep = std::move(rep)](file f) mutable {
+            rep->set_status(206u);
+            sstring boundary;
+            if (ranges.size() == 1) {
+                rep->add_header("content-range", content_range(ranges[0], size));
+            } else {
+                boundary = sprint("seastar-byteranges-%x", ++_boundaries);
+                rep->add_header("content-type", "multipart/byteranges; boundary=" + boundary);
+            }
+            return do_with(std::move(f), std::move(ranges), std::move(rep),
+                    [this, size, boundary](file& f, std::vector<byte_range>& ranges, std::unique_ptr<response>& rep) {
+                return do_for_each(ranges, [this, size, boundary, &f, &rep](const byte_range& range) {
+                    if (!boundary.empty()) {
+                        append_body(*rep, "\r\n--" + boundary + "\r\ncontent-range: " + content_range(range, size) + "\r\n\r\n");
+                    }
+                    // the file stream reads whole DMA-aligned blocks starting with the one
+                    // holding range.first and trims the head, nothing before it is read
+                    auto in = make_file_input_stream(f, range.first, range.last - range.first + 1,
+                                                     reader::stream_options(_zero_copy));
+                    auto r = std::make_shared<reader>(std::move(in), std::move(rep), _zero_copy);
+                    return r->is.consume(*r).finally([r] {
+                        return r->is.close();
+                    }).then([r, &rep] {
+                        rep = std::move(r->_rep);
+                    });
+                }).then([this, boundary, &rep] {
+                    if (!boundary.empty()) {
+                        append_body(*rep, "\r\n--" + boundary + "--\r\n");
+                    }
+                    return std::move(rep);
+                }).finally([&f] {
+                    return f.close();
+                });
+            });
+        });
+    }
+
 private:
+    void append_body(response& rep, const sstring& data) {
+        if (_zero_copy) {
+            rep._body_chunks.emplace_back(data.data(), data.size());
+        } else {
+            rep._body.append(data.data(), data.size());
+        }
+    }
+
     sstring doc_root;
+    bool _zero_copy;
+    uint64_t _boundaries {0};
+    lw_shared_ptr<static_bundle> _bundle;
 
 };
 
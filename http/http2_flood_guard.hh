@@ -0,0 +1,170 @@
+﻿/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2018 ScyllaDB Ltd.
+ */
+
+#pragma once
+
+#include "core/lowres_clock.hh"
+#include "core/sstring.hh"
+#include "core/metrics_registration.hh"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+namespace seastar {
+namespace httpd2 {
+
+using namespace std::chrono_literals;
+
+/*
+ * Number of events seen during the last window, kept in a ring of buckets so
+ * expiring old events costs a few increments instead of a timestamp per event.
+ */
+template<unsigned buckets = 8>
+class sliding_window_counter {
+public:
+    explicit sliding_window_counter(lowres_clock::duration window = 1s)
+        : _bucket_width(window / buckets), _head_start(lowres_clock::now()) {}
+
+    unsigned add(lowres_clock::time_point now = lowres_clock::now()) {
+        advance(now);
+        ++_buckets[_head];
+        return ++_total;
+    }
+
+    unsigned total(lowres_clock::time_point now = lowres_clock::now()) {
+        advance(now);
+        return _total;
+    }
+private:
+    void advance(lowres_clock::time_point now) {
+        auto elapsed = static_cast<unsigned>(std::min<int64_t>((now - _head_start) / _bucket_width, buckets));
+        for (auto i = 0u; i < elapsed; i++) {
+            _head = (_head + 1) % buckets;
+            _total -= _buckets[_head];
+            _buckets[_head] = 0;
+        }
+        if (elapsed == buckets) {
+            _head_start = now;
+        } else {
+            _head_start += elapsed * _bucket_width;
+        }
+    }
+
+    lowres_clock::duration _bucket_width;
+    lowres_clock::time_point _head_start;
+    std::array<unsigned, buckets> _buckets {};
+    unsigned _head {0};
+    unsigned _total {0};
+};
+
+enum class abuse {
+    reset,
+    control_frame,
+    empty_data,
+    header_only_stream
+};
+
+constexpr inline auto abuse_kinds = 4u;
+
+/*
+ * Shard-wide counters for abusive frame patterns, exported as metrics.
+ */
+class flood_stats {
+public:
+    explicit flood_stats(const sstring& name) {
+        namespace sm = seastar::metrics;
+        std::vector<sm::label_instance> labels;
+        labels.push_back(sm::label_instance("service", name));
+        _metric_groups.add_group("httpd2", {
+            sm::make_derive("peer_resets", [this] { return _events[index(abuse::reset)]; },
+                            sm::description("The total number of RST_STREAM frames received from clients"), labels),
+            sm::make_derive("peer_control_frames", [this] { return _events[index(abuse::control_frame)]; },
+                            sm::description("The total number of non-ACK SETTINGS and PING frames received from clients"), labels),
+            sm::make_derive("peer_empty_data_frames", [this] { return _events[index(abuse::empty_data)]; },
+                            sm::description("The total number of empty DATA frames without END_STREAM received from clients"), labels),
+            sm::make_derive("peer_header_only_streams", [this] { return _events[index(abuse::header_only_stream)]; },
+                            sm::description("The total number of streams closed before the client finished the request"), labels),
+            sm::make_derive("enhance_your_calm", [this] { return _goaways; },
+                            sm::description("The total number of connections closed with GOAWAY(ENHANCE_YOUR_CALM)"), labels)
+        });
+    }
+
+    void count(abuse kind) {
+        ++_events[index(kind)];
+    }
+
+    void count_goaway() {
+        ++_goaways;
+    }
+private:
+    static unsigned index(abuse kind) {
+        return static_cast<unsigned>(kind);
+    }
+
+    std::array<uint64_t, abuse_kinds> _events {};
+    uint64_t _goaways {0};
+    metrics::metric_groups _metric_groups;
+};
+
+struct flood_guard_config {
+    lowres_clock::duration window = 1s;
+    // indexed by abuse kind
+    std::array<unsigned, abuse_kinds> limits {{200u, 100u, 100u, 200u}};
+};
+
+/*
+ * Per-connection detector of cheap-to-send, expensive-to-serve frame patterns
+ * (rapid reset, SETTINGS/PING floods, empty DATA, abandoned streams). Legitimate
+ * clients stay far below the limits, so tripping any of them earns the connection
+ * a GOAWAY(ENHANCE_YOUR_CALM).
+ */
+class flood_guard {
+public:
+    using config = flood_guard_config;
+
+    explicit flood_guard(flood_stats *stats = nullptr, config cfg = config())
+        : _stats(stats), _cfg(cfg)
+        , _counters{{sliding_window_counter<>(cfg.window), sliding_window_counter<>(cfg.window),
+                     sliding_window_counter<>(cfg.window), sliding_window_counter<>(cfg.window)}} {}
+
+    // returns true once the connection crossed the limit for given pattern
+    bool on_event(abuse kind) {
+        auto i = static_cast<unsigned>(kind);
+        if (_stats) {
+            _stats->count(kind);
+        }
+        _tripped = _tripped || _counters[i].add() > _cfg.limits[i];
+        return _tripped;
+    }
+
+    bool tripped() const {
+        return _tripped;
+    }
+private:
+    flood_stats *_stats;
+    config _cfg;
+    std::array<sliding_window_counter<>, abuse_kinds> _counters;
+    bool _tripped {false};
+};
+
+}
+}
@@ -0,0 +1,132 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2018 ScyllaDB Ltd.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+namespace seastar {
+namespace httpd2 {
+
+/*
+ * Log-linear (HDR-style) histogram of latencies in nanoseconds. Values below
+ * sub_buckets are counted exactly, above that every power of two range is split
+ * into sub_buckets / 2 linear buckets, so any recorded value is known within
+ * 2 / sub_buckets (1.6%) of itself. Recording is a couple of shifts and an
+ * increment, and histograms of different shards merge by adding counters.
+ */
+class latency_histogram {
+public:
+    static constexpr unsigned sub_bucket_bits = 7u;
+    static constexpr unsigned sub_buckets = 1u << sub_bucket_bits;
+    static constexpr unsigned half = sub_buckets / 2;
+    static constexpr unsigned buckets = (64u - sub_bucket_bits + 2) * half;
+
+    template<typename Rep, typename Period>
+    void record(std::chrono::duration<Rep, Period> latency) {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count();
+        record(static_cast<uint64_t>(std::max<decltype(ns)>(ns, 0)));
+    }
+
+    void record(uint64_t value) {
+        ++_counts[index(value)];
+        ++_count;
+        _min = std::min(_min, value);
+        _max = std::max(_max, value);
+    }
+
+    void merge(const latency_histogram &other) {
+        for (auto i = 0u; i < buckets; i++) {
+            _counts[i] += other._counts[i];
+        }
+        _count += other._count;
+        _min = std::min(_min, other._min);
+        _max = std::max(_max, other._max);
+    }
+
+    uint64_t count() const {
+        return _count;
+    }
+    uint64_t min() const {
+        return _count? _min : 0;
+    }
+    uint64_t max() const {
+        return _max;
+    }
+
+    // highest value of the bucket holding the p-th (0..1) recorded value
+    uint64_t percentile(double p) const {
+        if (!_count) {
+            return 0;
+        }
+        auto rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(p * _count)));
+        auto seen = uint64_t(0);
+        for (auto i = 0u; i < buckets; i++) {
+            seen += _counts[i];
+            if (seen >= rank) {
+                return std::min(highest_value(i), _max);
+            }
+        }
+        return _max;
+    }
+
+    // calls func(highest value, count) for every non-empty bucket, in order
+    template<typename Func>
+    void for_each_bucket(Func &&func) const {
+        for (auto i = 0u; i < buckets; i++) {
+            if (_counts[i]) {
+                func(highest_value(i), _counts[i]);
+            }
+        }
+    }
+
+    static unsigned index(uint64_t value) {
+        if (value < sub_buckets) {
+            return value;
+        }
+        // value >> shift falls in [half, sub_buckets)
+        auto shift = 64u - sub_bucket_bits - __builtin_clzll(value);
+        return shift * half + (value >> shift);
+    }
+
+    static uint64_t highest_value(unsigned index) {
+        if (index < sub_buckets) {
+            return index;
+        }
+        auto shift = index / half - 1;
+        auto sub = uint64_t(index - shift * half);
+        // wraps to the maximum for the very last bucket
+        return ((sub + 1) << shift) - 1;
+    }
+private:
+    std::array<uint64_t, buckets> _counts {};
+    uint64_t _count {0};
+    uint64_t _min {std::numeric_limits<uint64_t>::max()};
+    uint64_t _max {0};
+};
+
+}
+}
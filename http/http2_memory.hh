@@ -0,0 +1,241 @@
+﻿/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2018 ScyllaDB Ltd.
+ */
+
+#pragma once
+
+#include "core/sstring.hh"
+#include "core/metrics.hh"
+#include "core/metrics_registration.hh"
+#include <nghttp2/nghttp2.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+#include <sys/types.h>
+
+namespace seastar {
+namespace httpd2 {
+
+struct pool_stats {
+    uint64_t hits {0};
+    uint64_t misses {0};
+    size_t cached {0};
+};
+
+/*
+ * Per-shard free list of T sized blocks. Streams, requests and responses are
+ * created and destroyed once per request, so after warm-up they are recycled
+ * in O(1) without touching the allocator. The list is bounded, bursts above
+ * max_cached objects go back to the shard allocator.
+ */
+template<typename T, size_t max_cached = 4096>
+class object_pool {
+    struct node {
+        node *next;
+    };
+    static_assert(sizeof(T) >= sizeof(node), "object too small for the free list");
+
+    static inline thread_local node *_free = nullptr;
+    static inline thread_local pool_stats _stats;
+public:
+    static void *allocate() {
+        if (_free) {
+            auto n = _free;
+            _free = n->next;
+            --_stats.cached;
+            ++_stats.hits;
+            return n;
+        }
+        ++_stats.misses;
+        return ::operator new(sizeof(T));
+    }
+
+    static void deallocate(void *ptr) {
+        if (_stats.cached >= max_cached) {
+            ::operator delete(ptr);
+            return;
+        }
+        auto n = static_cast<node*>(ptr);
+        n->next = _free;
+        _free = n;
+        ++_stats.cached;
+    }
+
+    static const pool_stats &stats() {
+        return _stats;
+    }
+};
+
+/*
+ * Mixin routing class specific new/delete of T through object_pool<T>.
+ * Derived classes of other sizes fall back to the global allocator.
+ */
+template<typename T, size_t max_cached = 4096>
+struct pooled {
+    static void *operator new(size_t size) {
+        if (size != sizeof(T)) {
+            return ::operator new(size);
+        }
+        return object_pool<T, max_cached>::allocate();
+    }
+
+    static void operator delete(void *ptr, size_t size) {
+        if (size != sizeof(T)) {
+            ::operator delete(ptr);
+            return;
+        }
+        object_pool<T, max_cached>::deallocate(ptr);
+    }
+};
+
+/*
+ * nghttp2_mem hooks for a single session. Everything nghttp2 allocates for it
+ * (HPACK tables, frame queues, stream state) is served by the owning shard's
+ * allocator and accounted per connection and per shard. Allocations that
+ * would exceed the budget fail, nghttp2 reports NGHTTP2_ERR_NOMEM and the
+ * connection is torn down instead of growing without bound.
+ */
+class session_memory {
+    struct alignas(alignof(std::max_align_t)) header {
+        size_t size;
+    };
+public:
+    // budget of 0 means unlimited
+    explicit session_memory(size_t budget = 0)
+        : _budget(budget) {
+        _mem.mem_user_data = this;
+        _mem.malloc = [](size_t size, void *ud) {
+            return static_cast<session_memory*>(ud)->allocate(size);
+        };
+        _mem.free = [](void *ptr, void *ud) {
+            static_cast<session_memory*>(ud)->release(ptr);
+        };
+        _mem.calloc = [](size_t nmemb, size_t size, void *ud) -> void* {
+            if (size && nmemb > SIZE_MAX / size) {
+                return nullptr;
+            }
+            auto ptr = static_cast<session_memory*>(ud)->allocate(nmemb * size);
+            if (ptr) {
+                std::memset(ptr, 0, nmemb * size);
+            }
+            return ptr;
+        };
+        _mem.realloc = [](void *ptr, size_t size, void *ud) {
+            return static_cast<session_memory*>(ud)->reallocate(ptr, size);
+        };
+    }
+    session_memory(const session_memory&) = delete;
+    session_memory &operator=(const session_memory&) = delete;
+
+    nghttp2_mem *get() {
+        return &_mem;
+    }
+
+    size_t used() const {
+        return _used;
+    }
+
+    void set_budget(size_t budget) {
+        _budget = budget;
+    }
+
+    static size_t shard_used() {
+        return _shard_used;
+    }
+private:
+    bool fits(size_t more) const {
+        return !_budget || _used + more <= _budget;
+    }
+
+    void account(ssize_t delta) {
+        _used += delta;
+        _shard_used += delta;
+    }
+
+    void *allocate(size_t size) {
+        if (!fits(size)) {
+            return nullptr;
+        }
+        auto hdr = static_cast<header*>(std::malloc(sizeof(header) + size));
+        if (!hdr) {
+            return nullptr;
+        }
+        hdr->size = size;
+        account(size);
+        return hdr + 1;
+    }
+
+    void release(void *ptr) {
+        if (!ptr) {
+            return;
+        }
+        auto hdr = static_cast<header*>(ptr) - 1;
+        account(-static_cast<ssize_t>(hdr->size));
+        std::free(hdr);
+    }
+
+    void *reallocate(void *ptr, size_t size) {
+        if (!ptr) {
+            return allocate(size);
+        }
+        auto hdr = static_cast<header*>(ptr) - 1;
+        auto old_size = hdr->size;
+        if (size > old_size && !fits(size - old_size)) {
+            return nullptr;
+        }
+        auto moved = static_cast<header*>(std::realloc(hdr, sizeof(header) + size));
+        if (!moved) {
+            return nullptr;
+        }
+        moved->size = size;
+        account(static_cast<ssize_t>(size) - static_cast<ssize_t>(old_size));
+        return moved + 1;
+    }
+
+    nghttp2_mem _mem;
+    size_t _budget;
+    size_t _used {0};
+    static inline thread_local size_t _shard_used = 0;
+};
+
+/*
+ * Exports the shard's nghttp2 session memory, independently of whether
+ * admission control is in use.
+ */
+class session_memory_metrics {
+public:
+    explicit session_memory_metrics(const sstring& name) {
+        namespace sm = seastar::metrics;
+        std::vector<sm::label_instance> labels;
+        labels.push_back(sm::label_instance("service", name));
+        _metric_groups.add_group("httpd2", {
+            sm::make_gauge("nghttp2_memory", [] { return session_memory::shard_used(); },
+                           sm::description("Bytes allocated by nghttp2 sessions on this shard"), labels)
+        });
+    }
+private:
+    metrics::metric_groups _metric_groups;
+};
+
+}
+}
@@ -29,29 +29,13 @@ namespace httpd2 {
 request::request(std::initializer_list<std::pair<sstring, sstring> > headers)
     : headers_utils(headers)  {}
 
-template<size_t size>
-static inline bool fast_compare(const sstring& that, const char *x) {
-    return that.size() == size && std::equal(that.begin(), that.end(), x);
-}
-
-void request::add_header(const request_feed &feed) {
-    const sstring header(reinterpret_cast<const char*>(std::get<0>(feed)));
-    const sstring content(reinterpret_cast<const char*>(std::get<2>(feed)));
-    if (fast_compare<sizeof(":method") - 1>(header, ":method")) {
-        _method = std::move(content);
-    } else if (fast_compare<sizeof(":path") - 1>(header, ":path")) {
-         _path = std::move(content);
-    } else if (fast_compare<sizeof(":scheme") - 1>(header, ":scheme")) {
-         _scheme = std::move(content);
-    }
-}
-
 request* request::add_header(const sstring& header, const sstring& value) {
     _headers.push_back({header,value});
     return this;
 }
 
 void response::add_headers(std::initializer_list<std::pair<sstring, sstring> > headers) {
+    _headers.reserve(_headers.size() + headers.size());
     _headers.insert(_headers.end(), headers.begin(), headers.end());
 }
 
@@ -60,6 +44,10 @@ response *response::add_header(const sstring &header, const sstring &value) {
     return this;
 }
 
+void response::add_status_header(const sstring &status) {
+    _headers.insert(_headers.begin(), {":status", status});
+}
+
 size_t response::flush_body(uint8_t *out_buffer, size_t, uint32_t *out_flags) {
     constexpr auto NGHTTP2_MAX_PAYLOADLEN = 16384L;
     auto remaining_part = (_body.c_str() + _body.size()) - _body_head;
@@ -75,5 +63,43 @@ size_t response::flush_body(uint8_t *out_buffer, size_t, uint32_t *out_flags) {
     return chunk_size;
 }
 
+size_t response::body_size() const {
+    auto size = _body.size();
+    for (const auto &chunk : _body_chunks) {
+        size += chunk.size();
+    }
+    return size;
+}
+
+size_t response::flush_body_chunks(size_t length, uint32_t *out_flags) {
+    while (_chunk < _body_chunks.size() && _chunk_offset == _body_chunks[_chunk].size()) {
+        ++_chunk;
+        _chunk_offset = 0;
+    }
+    size_t chunk_size = 0;
+    if (_chunk < _body_chunks.size()) {
+        // a frame never spans two buffers, so its payload is a single share
+        chunk_size = std::min(length, _body_chunks[_chunk].size() - _chunk_offset);
+    }
+    if (debug_on_file) {
+        fmt::print("chunk: {} offset: {} chunk size: {}\n", _chunk, _chunk_offset, chunk_size);
+    }
+    *out_flags |= NGHTTP2_DATA_FLAG_NO_COPY;
+    if (_chunk == _body_chunks.size()
+            || (_chunk + 1 == _body_chunks.size() && _chunk_offset + chunk_size == _body_chunks[_chunk].size())) {
+        *out_flags |= NGHTTP2_DATA_FLAG_EOF;
+    }
+    return chunk_size;
+}
+
+temporary_buffer<char> response::take_body(size_t length) {
+    if (length == 0) {
+        return temporary_buffer<char>();
+    }
+    auto payload = _body_chunks[_chunk].share(_chunk_offset, length);
+    _chunk_offset += length;
+    return payload;
+}
+
 }
 }
@@ -21,16 +21,21 @@
 #pragma once
 
 #include "core/sstring.hh"
+#include "core/shared_ptr.hh"
+#include "core/temporary_buffer.hh"
+#include "http2_memory.hh"
 #include <nghttp2/nghttp2.h>
 #include <optional>
 #include <memory>
 #include <tuple>
 #include <unordered_map>
+#include <algorithm>
 #include <array>
 #include <vector>
-#include <variant>
 #include <stdexcept>
 #include <initializer_list>
+#include <chrono>
+#include <ctime>
 
 namespace seastar {
 namespace httpd2 {
@@ -53,13 +58,33 @@ private:
 
 enum class method
 {
-    GET
+    GET,
+    POST
 };
 
-using request_feed = std::tuple<const uint8_t*, size_t, const uint8_t*, size_t>;
-using data_chunk_feed = std::tuple<const uint8_t*, size_t>;
-using nghttp2_internal_data = std::variant<const nghttp2_frame*, int32_t, data_chunk_feed,
-                                            std::tuple<const nghttp2_frame*, request_feed>>;
+// IMF-fixdate, as used by last-modified and if-modified-since
+inline sstring to_http_date(std::chrono::system_clock::time_point tp) {
+    auto t = std::chrono::system_clock::to_time_t(tp);
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    char buf[64];
+    auto len = strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return sstring(buf, len);
+}
+
+inline std::optional<std::chrono::system_clock::time_point> parse_http_date(const sstring& date) {
+    struct tm tm = {};
+    auto end = strptime(date.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end) {
+        return std::nullopt;
+    }
+    return std::chrono::system_clock::from_time_t(timegm(&tm));
+}
+
+template<size_t size>
+inline bool fast_compare(const uint8_t *name, size_t len, const char (&x)[size]) {
+    return len == size - 1 && std::equal(name, name + len, x);
+}
 
 class headers_utils {
     static uint8_t* do_cast(const char *ptr) {
@@ -85,10 +110,22 @@ public:
         : _headers(headers) {}
 
     void done() {
+        _nva.reserve(_nva.size() + _headers.size());
         for (const auto &item : _headers) {
             _nva.push_back(make_header(item.first, item.second));
         }
     }
+    const std::vector<std::pair<sstring, sstring>> &headers() const {
+        return _headers;
+    }
+    const sstring *find_header(const sstring &name) const {
+        for (const auto &header : _headers) {
+            if (header.first == name) {
+                return &header.second;
+            }
+        }
+        return nullptr;
+    }
     size_t size() const {
         return _nva.size();
     }
@@ -100,46 +137,105 @@ public:
     }
 };
 
-class request : public headers_utils {
+class request : public headers_utils, public enable_lw_shared_from_this<request>, public pooled<request> {
 public:
     request() = default;
     request(std::initializer_list<std::pair<sstring, sstring> > headers);
-    void add_header(const request_feed &feed);
+    // hot path, called from nghttp2 for every header of every request
+    void add_header(const uint8_t *name, size_t namelen, const uint8_t *value, size_t valuelen) {
+        // only headers the server acts on are kept, so don't build strings for the others
+        auto content = [value, valuelen] {
+            return sstring(reinterpret_cast<const char*>(value), valuelen);
+        };
+        if (namelen == 0) {
+            return;
+        }
+        if (name[0] != ':') {
+            if (fast_compare(name, namelen, "accept-encoding")) {
+                _accept_encoding = content();
+            } else if (fast_compare(name, namelen, "if-none-match")) {
+                _if_none_match = content();
+            } else if (fast_compare(name, namelen, "if-modified-since")) {
+                _if_modified_since = content();
+            } else if (fast_compare(name, namelen, "range")) {
+                _range = content();
+            } else if (fast_compare(name, namelen, "if-range")) {
+                _if_range = content();
+            }
+            return;
+        }
+        if (fast_compare(name, namelen, ":method")) {
+            _method = content();
+        } else if (fast_compare(name, namelen, ":path")) {
+            _path = content();
+        } else if (fast_compare(name, namelen, ":scheme")) {
+            _scheme = content();
+        }
+    }
     request *add_header(const sstring& header, const sstring& value);
     // minimal set of headers according RFC
     sstring _method;
     sstring _scheme;
     sstring _path;
+    sstring _accept_encoding;
+    sstring _if_none_match;
+    sstring _if_modified_since;
+    sstring _range;
+    sstring _if_range;
+    // received by the server, or sent by the client when not empty
+    sstring _body;
 };
 
-class response : public headers_utils {
+class response : public headers_utils, public pooled<response> {
     nghttp2_data_provider _prd;
 public:
     uint32_t _status_code {200u};
     sstring _body;
+    // used instead of _body for file contents, the DMA buffers are sent as they are
+    // (NGHTTP2_DATA_FLAG_NO_COPY) and each DATA frame carries a share of one of them
+    std::vector<temporary_buffer<char>> _body_chunks;
+    // HEAD and 304 responses are sent without DATA frames, content-length then
+    // describes the representation instead of the (empty) body
+    bool _header_only {false};
+    std::optional<size_t> _content_length;
 
     void add_headers(std::initializer_list<std::pair<sstring, sstring> > headers);
     response *add_header(const sstring& header, const sstring& value);
+    // :status has to precede the headers added by handlers
+    void add_status_header(const sstring& status);
     void flush_body() {
         _body_head = _body.c_str();
         _prd.source.ptr = reinterpret_cast<void*>(this);
+        if (!_body_chunks.empty()) {
+            _prd.read_callback = [](auto, auto, auto, auto length, auto flags, auto source, auto) -> ssize_t {
+                auto rep = reinterpret_cast<response*>(source->ptr);
+                return rep->flush_body_chunks(length, flags);
+            };
+            return;
+        }
         _prd.read_callback = [](auto, auto, auto buf, auto length, auto flags, auto source, auto) -> ssize_t {
             auto rep = reinterpret_cast<response*>(source->ptr);
             return rep->flush_body(buf, length, flags);
         };
     }
+    size_t body_size() const;
+    // payload of the DATA frame announced by the last flush_body_chunks()
+    temporary_buffer<char> take_body(size_t length);
 
     void set_status(uint32_t code) {
         _status_code = code;
     }
 
     const nghttp2_data_provider *get_provider() const {
-        return &_prd;
+        return _header_only? nullptr : &_prd;
     }
 private:
     const char *_body_head {nullptr};
+    size_t _chunk {0};
+    size_t _chunk_offset {0};
 
     size_t flush_body(uint8_t *out_buffer, size_t, uint32_t *out_flags);
+    size_t flush_body_chunks(size_t length, uint32_t *out_flags);
 };
 
 }
@@ -0,0 +1,206 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2018 ScyllaDB Ltd.
+ */
+
+#include "http2_response_cache.hh"
+#include <algorithm>
+#include <cctype>
+#include <string_view>
+
+namespace seastar {
+namespace httpd2 {
+
+static std::string_view trim(std::string_view s) {
+    auto begin = s.find_first_not_of(" \t");
+    if (begin == std::string_view::npos) {
+        return {};
+    }
+    auto end = s.find_last_not_of(" \t");
+    return s.substr(begin, end - begin + 1);
+}
+
+static bool iequals(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+        return std::tolower(x) == std::tolower(y);
+    });
+}
+
+static std::optional<std::chrono::seconds> seconds(std::string_view value) {
+    if (value.empty() || value.size() > 9 || value.find_first_not_of("0123456789") != std::string_view::npos) {
+        return std::nullopt;
+    }
+    return std::chrono::seconds(std::stol(std::string(value)));
+}
+
+cache_control parse_cache_control(const sstring &value) {
+    cache_control cc;
+    std::optional<std::chrono::seconds> s_maxage;
+    std::string_view rest(value.data(), value.size());
+    while (!rest.empty()) {
+        auto comma = rest.find(',');
+        auto directive = trim(rest.substr(0, comma));
+        rest = (comma == std::string_view::npos)? std::string_view() : rest.substr(comma + 1);
+
+        auto eq = directive.find('=');
+        auto name = trim(directive.substr(0, eq));
+        auto arg = (eq == std::string_view::npos)? std::string_view() : trim(directive.substr(eq + 1));
+        if (iequals(name, "no-store") || iequals(name, "no-cache") || iequals(name, "private")) {
+            cc.no_store = true;
+        } else if (iequals(name, "max-age")) {
+            cc.max_age = seconds(arg);
+        } else if (iequals(name, "s-maxage")) {
+            s_maxage = seconds(arg);
+        } else if (iequals(name, "stale-while-revalidate")) {
+            cc.stale_while_revalidate = seconds(arg).value_or(std::chrono::seconds(0));
+        }
+    }
+    if (s_maxage) {
+        cc.max_age = s_maxage;
+    }
+    return cc;
+}
+
+shared_response shared_response::capture(response &rep) {
+    shared_response shared;
+    shared.status = rep._status_code;
+    shared.headers = rep.headers();
+    if (!rep._body.empty()) {
+        // copied once, from now on rep and every restored response share the buffer
+        rep._body_chunks.emplace_back(rep._body.data(), rep._body.size());
+        rep._body = "";
+    }
+    shared.body.reserve(rep._body_chunks.size());
+    for (auto &chunk : rep._body_chunks) {
+        shared.body.push_back(chunk.share());
+    }
+    shared.content_length = rep._content_length;
+    shared.header_only = rep._header_only;
+    return shared;
+}
+
+void shared_response::restore(response &rep) {
+    rep._status_code = status;
+    for (const auto &header : headers) {
+        rep.add_header(header.first, header.second);
+    }
+    rep._body_chunks.reserve(body.size());
+    for (auto &chunk : body) {
+        rep._body_chunks.push_back(chunk.share());
+    }
+    rep._content_length = content_length;
+    rep._header_only = header_only;
+}
+
+size_t shared_response::size() const {
+    auto bytes = chunks_size(body);
+    for (const auto &header : headers) {
+        bytes += header.first.size() + header.second.size();
+    }
+    return bytes;
+}
+
+sstring response_cache::key(const request &req, bool vary_on_encoding) {
+    auto key = req._method + " " + req._path;
+    if (vary_on_encoding && accepts_encoding(req._accept_encoding, "gzip")) {
+        key += " gzip";
+    }
+    return key;
+}
+
+response_cache::freshness response_cache::lookup(const sstring &key, response &rep, clock_type::time_point now) {
+    auto it = _index.find(key);
+    if (it == _index.end() || now >= it->second->stale_until) {
+        ++_misses;
+        return freshness::miss;
+    }
+    ++_hits;
+    auto &e = *it->second;
+    _lru.splice(_lru.begin(), _lru, it->second);
+    e.rep.restore(rep);
+    rep.add_header("age", to_sstring(std::chrono::duration_cast<std::chrono::seconds>(now - e.stored).count()));
+    return (now < e.fresh_until)? freshness::fresh : freshness::stale;
+}
+
+bool response_cache::store(const sstring &key, response &rep, clock_type::time_point now) {
+    if (rep._status_code != 200u || rep._header_only) {
+        return false;
+    }
+    auto cache_control_header = rep.find_header("cache-control");
+    if (!cache_control_header) {
+        return false;
+    }
+    auto cc = parse_cache_control(*cache_control_header);
+    if (cc.no_store || !cc.max_age || cc.max_age->count() == 0) {
+        return false;
+    }
+    // the key only captures accept-encoding
+    auto vary = rep.find_header("vary");
+    if (vary && !iequals(trim(std::string_view(vary->data(), vary->size())), "accept-encoding")) {
+        return false;
+    }
+
+    entry e;
+    e.key = key;
+    e.rep = shared_response::capture(rep);
+    e.stored = now;
+    e.fresh_until = now + *cc.max_age;
+    e.stale_until = e.fresh_until + cc.stale_while_revalidate;
+    e.bytes = key.size() + e.rep.size();
+
+    auto it = _index.find(key);
+    if (it != _index.end()) {
+        erase(it->second);
+    }
+    if (e.bytes > _max_bytes) {
+        return false;
+    }
+    _bytes += e.bytes;
+    _lru.push_front(std::move(e));
+    _index.emplace(key, _lru.begin());
+    while (_bytes > _max_bytes) {
+        erase(std::prev(_lru.end()));
+    }
+    return true;
+}
+
+bool response_cache::start_revalidation(const sstring &key) {
+    auto it = _index.find(key);
+    if (it == _index.end() || it->second->revalidating) {
+        return false;
+    }
+    it->second->revalidating = true;
+    return true;
+}
+
+void response_cache::end_revalidation(const sstring &key) {
+    auto it = _index.find(key);
+    if (it != _index.end()) {
+        it->second->revalidating = false;
+    }
+}
+
+void response_cache::erase(std::list<entry>::iterator it) {
+    _bytes -= it->bytes;
+    _index.erase(it->key);
+    _lru.erase(it);
+}
+
+}
+}
@@ -0,0 +1,120 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2018 ScyllaDB Ltd.
+ */
+
+#pragma once
+
+#include "core/lowres_clock.hh"
+#include "core/sstring.hh"
+#include "http2_compression.hh"
+#include "http2_request_response.hh"
+#include <chrono>
+#include <list>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace seastar {
+namespace httpd2 {
+
+struct cache_control {
+    std::optional<std::chrono::seconds> max_age;
+    std::chrono::seconds stale_while_revalidate {0};
+    bool no_store {false};
+};
+
+// response directives of a shared cache, s-maxage wins over max-age
+cache_control parse_cache_control(const sstring &value);
+
+/*
+ * Status, headers and body of a complete response, which any number of
+ * responses can be rebuilt from by sharing the body buffers.
+ */
+struct shared_response {
+    uint32_t status {200u};
+    std::vector<std::pair<sstring, sstring>> headers;
+    body_chunks body;
+    std::optional<size_t> content_length;
+    bool header_only {false};
+
+    // moves a plain body into a buffer first, rep then shares it as well
+    static shared_response capture(response &rep);
+    void restore(response &rep);
+    size_t size() const;
+};
+
+/*
+ * Per-shard cache of complete responses of opt-in routes, keyed by method,
+ * path and, for routes that vary on it, whether gzip is accepted. Entries keep
+ * the headers set by the handler and the body buffers, which hits share rather
+ * than copy. Freshness follows the handler's cache-control: fresh for max-age,
+ * then served stale for stale-while-revalidate while a single request refreshes
+ * the entry in the background. Eviction is LRU by bytes.
+ */
+class response_cache {
+public:
+    using clock_type = lowres_clock;
+    enum class freshness {miss, fresh, stale};
+
+    explicit response_cache(size_t max_bytes = 32 << 20)
+        : _max_bytes(max_bytes) {}
+
+    static sstring key(const request &req, bool vary_on_encoding);
+
+    // fills rep from the cached response, unless it is a miss
+    freshness lookup(const sstring &key, response &rep, clock_type::time_point now = clock_type::now());
+    // keeps rep if it is a cacheable 200, rep then shares the cached buffers
+    bool store(const sstring &key, response &rep, clock_type::time_point now = clock_type::now());
+    // true for the one caller that should refresh a stale entry
+    bool start_revalidation(const sstring &key);
+    void end_revalidation(const sstring &key);
+
+    uint64_t hits() const {
+        return _hits;
+    }
+    uint64_t misses() const {
+        return _misses;
+    }
+    size_t bytes() const {
+        return _bytes;
+    }
+private:
+    struct entry {
+        sstring key;
+        shared_response rep;
+        clock_type::time_point stored;
+        clock_type::time_point fresh_until;
+        clock_type::time_point stale_until;
+        bool revalidating {false};
+        size_t bytes {0};
+    };
+    void erase(std::list<entry>::iterator it);
+
+    size_t _max_bytes;
+    size_t _bytes {0};
+    uint64_t _hits {0};
+    uint64_t _misses {0};
+    std::list<entry> _lru;
+    std::unordered_map<sstring, std::list<entry>::iterator> _index;
+};
+
+}
+}
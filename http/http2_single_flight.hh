@@ -0,0 +1,90 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2018 ScyllaDB Ltd.
+ */
+
+#pragma once
+
+#include "core/future.hh"
+#include "core/shared_future.hh"
+#include "core/shared_ptr.hh"
+#include "core/sstring.hh"
+#include "http2_response_cache.hh"
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+
+namespace seastar {
+namespace httpd2 {
+
+/*
+ * Per-shard table of requests whose response is being produced. The first
+ * request for a key becomes the leader and runs the handler, identical requests
+ * arriving before it completes join it and rebuild their response from the
+ * leader's, sharing its body buffers, so neither handler calls nor disk reads
+ * grow with the number of concurrent clients.
+ */
+class single_flight {
+public:
+    using result = lw_shared_ptr<shared_response>;
+
+    // empty for the leader, which has to call complete() or fail() for the key
+    std::optional<future<result>> join(const sstring &key) {
+        auto it = _flights.find(key);
+        if (it == _flights.end()) {
+            _flights.emplace(key, shared_promise<result>());
+            ++_leaders;
+            return std::nullopt;
+        }
+        ++_joined;
+        return it->second.get_shared_future();
+    }
+
+    void complete(const sstring &key, response &rep) {
+        auto it = _flights.find(key);
+        if (it == _flights.end()) {
+            return;
+        }
+        it->second.set_value(make_lw_shared<shared_response>(shared_response::capture(rep)));
+        _flights.erase(it);
+    }
+
+    void fail(const sstring &key, std::exception_ptr ex) {
+        auto it = _flights.find(key);
+        if (it == _flights.end()) {
+            return;
+        }
+        it->second.set_exception(std::move(ex));
+        _flights.erase(it);
+    }
+
+    uint64_t leaders() const {
+        return _leaders;
+    }
+    uint64_t joined() const {
+        return _joined;
+    }
+private:
+    std::unordered_map<sstring, shared_promise<result>> _flights;
+    uint64_t _leaders {0};
+    uint64_t _joined {0};
+};
+
+}
+}
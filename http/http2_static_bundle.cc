@@ -0,0 +1,152 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2018 ScyllaDB Ltd.
+ */
+
+#include "http2_static_bundle.hh"
+#include "http2_request_response.hh"
+#include "core/reactor.hh"
+#include "core/file.hh"
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+#include <sys/stat.h>
+
+namespace seastar {
+namespace httpd2 {
+
+// FNV-1a, only detects changes so it doesn't need to be cryptographic
+static uint64_t fnv1a(const char *data, size_t size, uint64_t hash = 14695981039346656037ull) {
+    for (size_t i = 0; i < size; i++) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+future<lw_shared_ptr<static_bundle>> static_bundle::load(sstring doc_root, size_t max_bytes) {
+    auto bundle = make_lw_shared<static_bundle>(static_bundle(max_bytes));
+    return bundle->load_directory(doc_root, "", {}).then([bundle] {
+        bundle->seal();
+        return bundle;
+    });
+}
+
+future<> static_bundle::load_directory(sstring root, sstring path, std::vector<std::pair<dev_t, ino_t>> ancestors) {
+    return open_directory(root + path).then([this, root, path, ancestors = std::move(ancestors)] (file dir) mutable {
+        return dir.stat().then([this, root, path, dir, ancestors = std::move(ancestors)] (struct stat st) mutable {
+            // followed symlinks may lead back to a directory being walked
+            auto id = std::make_pair(st.st_dev, st.st_ino);
+            if (std::find(ancestors.begin(), ancestors.end(), id) != ancestors.end()) {
+                return make_ready_future<>();
+            }
+            ancestors.push_back(id);
+            auto entries = make_lw_shared<std::vector<directory_entry>>();
+            auto listing = make_lw_shared(dir.list_directory([entries] (directory_entry de) {
+                entries->push_back(std::move(de));
+                return make_ready_future<>();
+            }));
+            return listing->done().then([this, root, path, entries, listing, ancestors = std::move(ancestors)] {
+                return do_for_each(*entries, [this, root, path, ancestors] (const directory_entry &de) {
+                    if (de.name == "." || de.name == "..") {
+                        return make_ready_future<>();
+                    }
+                    auto entry_path = path + "/" + de.name;
+                    auto load_entry = [this, root, entry_path, ancestors] (auto type) {
+                        if (type && *type == directory_entry_type::directory) {
+                            return load_directory(root, entry_path, ancestors);
+                        }
+                        if (type && *type == directory_entry_type::regular) {
+                            return load_file(root, entry_path);
+                        }
+                        return make_ready_future<>();
+                    };
+                    if (!de.type || *de.type == directory_entry_type::link) {
+                        // not every filesystem reports the type in directory entries,
+                        // and symlinks are served as what they point to
+                        return engine().file_type(root + entry_path).then(load_entry);
+                    }
+                    return load_entry(de.type);
+                });
+            }).finally([entries] {});
+        }).finally([dir] () mutable {
+            return dir.close();
+        });
+    });
+}
+
+future<> static_bundle::load_file(sstring root, sstring path) {
+    return open_file_dma(root + path, open_flags::ro).then([this, path] (file f) {
+        return f.stat().then([this, path, f] (struct stat st) mutable {
+            _bytes += st.st_size;
+            if (_bytes > _max_bytes) {
+                throw std::runtime_error(sprint("static bundle exceeds %d bytes at %s", _max_bytes, path));
+            }
+            auto mtime = std::chrono::system_clock::from_time_t(st.st_mtime);
+            if (st.st_size == 0) {
+                add(path, temporary_buffer<char>(), mtime);
+                return make_ready_future<>();
+            }
+            return f.dma_read_bulk<char>(0, st.st_size).then([this, path, mtime] (temporary_buffer<char> content) {
+                add(path, std::move(content), mtime);
+            });
+        }).finally([f] () mutable {
+            return f.close();
+        });
+    });
+}
+
+void static_bundle::add(sstring path, temporary_buffer<char> content, std::chrono::system_clock::time_point mtime) {
+    static_asset asset;
+    asset.content_hash = fnv1a(content.get(), content.size());
+    asset.etag = sprint("\"%016x\"", asset.content_hash);
+    asset.last_modified = to_http_date(mtime);
+    asset.mtime = mtime;
+    // below that a gzip header and trailer eat most of the gain
+    constexpr auto min_compressed_size = 256u;
+    if (content.size() >= min_compressed_size) {
+        auto compressed = gzip(content.get(), content.size());
+        if (chunks_size(compressed) < content.size() * 9 / 10) {
+            asset.gzip_body = std::move(compressed);
+            asset.gzip_etag = sprint("\"%016x-gz\"", asset.content_hash);
+        }
+    }
+    // the aligned DMA buffer may be larger than the file, keep only what's used
+    asset.body = temporary_buffer<char>(content.get(), content.size());
+    _assets.emplace(std::move(path), std::move(asset));
+}
+
+void static_bundle::seal() {
+    std::vector<const sstring*> paths;
+    paths.reserve(_assets.size());
+    for (auto &asset : _assets) {
+        paths.push_back(&asset.first);
+    }
+    std::sort(paths.begin(), paths.end(), [] (auto a, auto b) { return *a < *b; });
+    auto hash = fnv1a(nullptr, 0);
+    for (auto path : paths) {
+        hash = fnv1a(path->data(), path->size(), hash);
+        auto content_hash = _assets.find(*path)->second.content_hash;
+        hash = fnv1a(reinterpret_cast<const char*>(&content_hash), sizeof(content_hash), hash);
+    }
+    _hash = hash;
+}
+
+}
+}
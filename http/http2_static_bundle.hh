@@ -0,0 +1,91 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2018 ScyllaDB Ltd.
+ */
+
+#pragma once
+
+#include "core/future.hh"
+#include "core/shared_ptr.hh"
+#include "core/sstring.hh"
+#include "core/temporary_buffer.hh"
+#include "http2_compression.hh"
+#include <chrono>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
+
+namespace seastar {
+namespace httpd2 {
+
+struct static_asset {
+    temporary_buffer<char> body;
+    // empty when compression doesn't pay off
+    body_chunks gzip_body;
+    uint64_t content_hash;
+    sstring etag;
+    sstring gzip_etag;
+    sstring last_modified;
+    std::chrono::system_clock::time_point mtime;
+};
+
+/*
+ * In-memory copy of a document root, served without any file I/O. Validators,
+ * last-modified and the gzip variant of every asset are computed once, at load
+ * time, and the bundle is never modified afterwards. Each shard loads its own
+ * replica so serving never crosses shards; responses in flight keep sharing the
+ * buffers of the bundle they started with when a newer one replaces it.
+ */
+class static_bundle {
+public:
+    // walks doc_root recursively, failing when the files exceed max_bytes
+    static future<lw_shared_ptr<static_bundle>> load(sstring doc_root, size_t max_bytes = 64 << 20);
+
+    static_asset *find(const sstring &path) {
+        auto it = _assets.find(path);
+        return (it != _assets.end())? &it->second : nullptr;
+    }
+    // covers all paths and contents, an unchanged tree loads with the same hash
+    uint64_t hash() const {
+        return _hash;
+    }
+    size_t size() const {
+        return _assets.size();
+    }
+    size_t bytes() const {
+        return _bytes;
+    }
+private:
+    explicit static_bundle(size_t max_bytes)
+        : _max_bytes(max_bytes) {}
+    // ancestors are the (device, inode) pairs of the directories above path
+    future<> load_directory(sstring root, sstring path, std::vector<std::pair<dev_t, ino_t>> ancestors);
+    future<> load_file(sstring root, sstring path);
+    void add(sstring path, temporary_buffer<char> content, std::chrono::system_clock::time_point mtime);
+    void seal();
+
+    std::unordered_map<sstring, static_asset> _assets;
+    size_t _max_bytes;
+    size_t _bytes {0};
+    uint64_t _hash {0};
+};
+
+}
+}
@@ -0,0 +1,355 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2018 ScyllaDB Ltd.
+ */
+
+#include "http2_upstream.hh"
+#include "core/reactor.hh"
+#include <utility>
+
+namespace seastar {
+namespace httpd2 {
+
+// body of a response, fed by the connection's receive loop, an empty buffer ends it
+class upstream::body_source final : public data_source_impl {
+    lw_shared_ptr<body_channel> _body;
+public:
+    explicit body_source(lw_shared_ptr<body_channel> body)
+        : _body(std::move(body)) {}
+    ~body_source() {
+        _body->abandon();
+    }
+    future<temporary_buffer<char>> get() override {
+        return _body->chunks.pop_eventually().then([body = _body] (temporary_buffer<char> chunk) {
+            body->consumed(chunk.size());
+            return chunk;
+        });
+    }
+};
+
+void upstream::body_channel::push(temporary_buffer<char> chunk) {
+    if (abandoned) {
+        give_back(chunk.size(), false);
+        return;
+    }
+    queued += chunk.size();
+    chunks.push(std::move(chunk));
+}
+
+void upstream::body_channel::consumed(size_t len) {
+    queued -= len;
+    give_back(len, true);
+}
+
+void upstream::body_channel::abort(std::exception_ptr ex) {
+    give_back(std::exchange(queued, 0), false);
+    chunks.abort(std::move(ex));
+}
+
+void upstream::body_channel::abandon() {
+    if (abandoned) {
+        return;
+    }
+    abandoned = true;
+    give_back(std::exchange(queued, 0), true);
+    chunks.abort(std::make_exception_ptr(upstream_error("response body abandoned")));
+}
+
+void upstream::body_channel::give_back(size_t len, bool flush) noexcept {
+    if (!len || !*conn) {
+        return;
+    }
+    // also runs from ~body_source, and a connection failing meanwhile fails
+    // its streams through the receive loop anyway
+    try {
+        (*conn)->consume(stream_id, len);
+        if (flush) {
+            (*conn)->send_requests().handle_exception([] (std::exception_ptr) {});
+        }
+    } catch (...) {
+    }
+}
+
+namespace {
+
+sstring as_sstring(const uint8_t *data, size_t len) {
+    return sstring(reinterpret_cast<const char*>(data), len);
+}
+
+}
+
+const sstring *client_response::find_header(const sstring &name) const {
+    for (const auto &header : headers) {
+        if (header.first == name) {
+            return &header.second;
+        }
+    }
+    return nullptr;
+}
+
+upstream::upstream(upstream_config cfg)
+    : _cfg(std::move(cfg)) {
+    // bodies give their bytes back as they are read, see body_channel
+    _routes._manual_window_update = true;
+    if (!_cfg.connect) {
+        _cfg.connect = [server = _cfg.server] {
+            return engine().net().connect(server);
+        };
+    }
+}
+
+future<client_response> upstream::send(lw_shared_ptr<request> req) {
+    return with_gate(_gate, [this, req = std::move(req)] {
+        return pick().then([this, req] (connection *c) {
+            return submit(*c, req);
+        });
+    });
+}
+
+lw_shared_ptr<request> upstream::make_request(const sstring &method, const sstring &path,
+                                              std::vector<std::pair<sstring, sstring>> headers) const {
+    auto req = make_lw_shared<request>({{":method", method}, {":path", path},
+                                        {":scheme", _cfg.scheme}, {":authority", _cfg.authority}});
+    for (auto &header : headers) {
+        req->add_header(header.first, header.second);
+    }
+    req->done();
+    return req;
+}
+
+upstream::~upstream() {
+    // bodies still being read must not reach the connections
+    for (auto &c : _connections) {
+        if (c.ref) {
+            *c.ref = nullptr;
+        }
+    }
+}
+
+future<> upstream::connect() {
+    return with_gate(_gate, [this] {
+        return open().then([] (connection*) {});
+    });
+}
+
+future<> upstream::close() {
+    _closing = true;
+    auto closed = _gate.close();
+    for (auto &waiter : _waiters) {
+        waiter.set_exception(upstream_error("upstream closed"));
+    }
+    _waiters.clear();
+    return parallel_for_each(_connections, [] (connection &c) {
+        return c.conn->finish();
+    }).then([closed = std::move(closed)] () mutable {
+        return std::move(closed);
+    });
+}
+
+connection_stats upstream::stats() const {
+    auto stats = _closed_stats;
+    for (auto &c : _connections) {
+        stats.merge(c.conn->stats());
+    }
+    return stats;
+}
+
+future<upstream::connection*> upstream::pick() {
+    connection *best = nullptr;
+    for (auto &c : _connections) {
+        if (c.conn->can_submit() && (!best || c.conn->pending_streams() < best->conn->pending_streams())) {
+            best = &c;
+        }
+    }
+    if (best) {
+        return make_ready_future<connection*>(best);
+    }
+    // a connection being opened will have free streams soon
+    if (!_connecting && _connections.size() < _cfg.max_connections) {
+        return open();
+    }
+    if (_closing) {
+        return make_exception_future<connection*>(upstream_error("upstream closed"));
+    }
+    _waiters.emplace_back();
+    return _waiters.back().get_future().then([this] {
+        return pick();
+    });
+}
+
+future<upstream::connection*> upstream::open() {
+    if (_closing) {
+        return make_exception_future<connection*>(upstream_error("upstream closed"));
+    }
+    // held until the connection is gone, so close() waits for it
+    _gate.enter();
+    ++_connecting;
+    return _cfg.connect().then_wrapped([this] (future<connected_socket> f) {
+        --_connecting;
+        if (f.failed()) {
+            _gate.leave();
+            // let a waiting request try on its own
+            wake_one();
+            return make_exception_future<connection*>(f.get_exception());
+        }
+        auto &c = _connections.emplace_back();
+        c.conn = std::make_unique<http2_connection<session_t::client>>(_routes, f.get0());
+        c.ref = make_lw_shared<http2_connection<session_t::client>*>(c.conn.get());
+        c.conn->keep_open(!_closing);
+        observe(c);
+        wake_all();
+        c.conn->process_internal(false).then_wrapped([this, &c] (future<> f) {
+            f.ignore_ready_future();
+            on_connection_closed(c);
+            _gate.leave();
+        });
+        return make_ready_future<connection*>(&c);
+    });
+}
+
+future<client_response> upstream::submit(connection &c, lw_shared_ptr<request> req) {
+    auto stream_id = c.conn->submit_request(std::move(req));
+    if (stream_id <= 0) {
+        return make_exception_future<client_response>(nghttp2_exception("nghttp2_submit_request", stream_id));
+    }
+    auto &stream = c.streams[stream_id];
+    auto ready = stream.ready.get_future();
+    // the receive loop only sends after it read something
+    c.conn->send_requests().handle_exception([] (std::exception_ptr) {
+        // the connection's receive loop fails the stream
+    });
+    return ready;
+}
+
+void upstream::observe(connection &c) {
+    http2_connection<session_t::client>::stream_observer observer;
+    observer.headers = [this, &c] (int32_t stream_id) {
+        on_headers(c, stream_id);
+    };
+    observer.closed = [this, &c] (int32_t stream_id, uint32_t error_code) {
+        on_close(c, stream_id, error_code);
+    };
+    observer.header = [this, &c] (int32_t stream_id, const uint8_t *name, size_t namelen,
+                                  const uint8_t *value, size_t valuelen) {
+        on_header(c, stream_id, name, namelen, value, valuelen);
+    };
+    observer.data = [this, &c] (int32_t stream_id, temporary_buffer<char> chunk, bool end_of_stream) {
+        on_data(c, stream_id, std::move(chunk), end_of_stream);
+    };
+    c.conn->observe_streams(std::move(observer));
+}
+
+void upstream::on_header(connection &c, int32_t stream_id, const uint8_t *name, size_t namelen,
+                         const uint8_t *value, size_t valuelen) {
+    auto it = c.streams.find(stream_id);
+    if (it == c.streams.end() || it->second.headers_done) {
+        // trailers aren't passed on
+        return;
+    }
+    auto &rep = it->second.rep;
+    if (fast_compare(name, namelen, ":status")) {
+        // nghttp2 already checked it is three digits
+        rep.status = 0;
+        for (auto i = 0u; i < valuelen; i++) {
+            rep.status = rep.status * 10 + (value[i] - '0');
+        }
+        return;
+    }
+    rep.headers.emplace_back(as_sstring(name, namelen), as_sstring(value, valuelen));
+}
+
+void upstream::on_headers(connection &c, int32_t stream_id) {
+    auto it = c.streams.find(stream_id);
+    if (it == c.streams.end() || it->second.headers_done) {
+        return;
+    }
+    auto &stream = it->second;
+    stream.headers_done = true;
+    stream.body = make_lw_shared<body_channel>(c.ref, stream_id);
+    stream.rep.body = input_stream<char>(data_source(std::make_unique<body_source>(stream.body)));
+    stream.ready.set_value(std::move(stream.rep));
+}
+
+void upstream::on_data(connection &c, int32_t stream_id, temporary_buffer<char> chunk, bool end_of_stream) {
+    auto it = c.streams.find(stream_id);
+    if (it == c.streams.end() || !it->second.body || it->second.body_done) {
+        // nobody will read it
+        c.conn->consume(stream_id, chunk.size());
+        return;
+    }
+    auto &stream = it->second;
+    if (end_of_stream) {
+        stream.body_done = true;
+        stream.body->push(temporary_buffer<char>());
+    } else if (!chunk.empty()) {
+        // shares the connection's read buffer, no copy
+        stream.body->push(std::move(chunk));
+    }
+}
+
+void upstream::on_close(connection &c, int32_t stream_id, uint32_t error_code) {
+    auto it = c.streams.find(stream_id);
+    if (it == c.streams.end()) {
+        return;
+    }
+    auto &stream = it->second;
+    if (!stream.headers_done) {
+        stream.ready.set_exception(upstream_error(format("stream closed before the response: {}",
+                                                         nghttp2_http2_strerror(error_code))));
+    } else if (!stream.body_done) {
+        stream.body->abort(std::make_exception_ptr(upstream_error(format("response body reset: {}",
+                                                                         nghttp2_http2_strerror(error_code)))));
+    }
+    c.streams.erase(it);
+    wake_one();
+}
+
+void upstream::on_connection_closed(connection &c) {
+    *c.ref = nullptr;
+    for (auto &[stream_id, stream] : c.streams) {
+        if (!stream.headers_done) {
+            stream.ready.set_exception(upstream_error("connection closed"));
+        } else if (!stream.body_done) {
+            stream.body->abort(std::make_exception_ptr(upstream_error("connection closed")));
+        }
+    }
+    c.conn->shutdown();
+    _closed_stats.merge(c.conn->stats());
+    _connections.remove_if([&c] (const connection &other) {
+        return &other == &c;
+    });
+    wake_one();
+}
+
+void upstream::wake_one() {
+    if (!_waiters.empty()) {
+        _waiters.front().set_value();
+        _waiters.pop_front();
+    }
+}
+
+void upstream::wake_all() {
+    for (auto &waiter : _waiters) {
+        waiter.set_value();
+    }
+    _waiters.clear();
+}
+
+}
+}
@@ -0,0 +1,170 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2018 ScyllaDB Ltd.
+ */
+
+#pragma once
+
+#include "core/future.hh"
+#include "core/gate.hh"
+#include "core/iostream.hh"
+#include "core/queue.hh"
+#include "core/shared_ptr.hh"
+#include "core/sstring.hh"
+#include "net/api.hh"
+#include "http2_connection.hh"
+#include <deque>
+#include <functional>
+#include <limits>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace seastar {
+namespace httpd2 {
+
+class upstream_error final : public std::exception {
+public:
+    explicit upstream_error(sstring msg)
+        : _msg(std::move(msg)) {}
+    const char* what() const noexcept override {
+        return _msg.c_str();
+    }
+private:
+    sstring _msg;
+};
+
+// ready as soon as the response headers arrived, the body streams in after
+struct client_response {
+    uint32_t status {0};
+    std::vector<std::pair<sstring, sstring>> headers;
+    input_stream<char> body;
+
+    const sstring *find_header(const sstring &name) const;
+};
+
+struct upstream_config {
+    // server to connect to, unless connect is set
+    socket_address server;
+    // opens a new connection, e.g. over TLS
+    std::function<future<connected_socket>()> connect;
+    sstring authority;
+    sstring scheme {"http"};
+    unsigned max_connections {4u};
+};
+
+/*
+ * Asynchronous client of one HTTP/2 backend. Connections are persistent and
+ * shared by all requests, every request goes to the open connection with the
+ * fewest streams in flight. A new connection is opened, one at a time, only
+ * once all of them ran out of streams, past max_connections requests wait for
+ * a stream to close. Connections lost to the server are dropped, failing
+ * their streams.
+ */
+class upstream {
+public:
+    explicit upstream(upstream_config cfg);
+    ~upstream();
+    upstream(const upstream&) = delete;
+    upstream &operator=(const upstream&) = delete;
+
+    // headers are sent as they are, pseudo-headers included
+    future<client_response> send(lw_shared_ptr<request> req);
+    // request with :method, :path, :scheme and :authority set from the config
+    lw_shared_ptr<request> make_request(const sstring &method, const sstring &path,
+                                        std::vector<std::pair<sstring, sstring>> headers = {}) const;
+    // opens a connection now instead of on the first request
+    future<> connect();
+    // lets the pending streams finish, then closes all connections
+    future<> close();
+
+    size_t connections() const {
+        return _connections.size();
+    }
+    // traffic of all connections, the closed ones included
+    connection_stats stats() const;
+private:
+    using connection_ref = lw_shared_ptr<http2_connection<session_t::client>*>;
+    // body of a response, shared by the stream and its reader. The session
+    // doesn't update the flow control windows on its own, a chunk's bytes are
+    // given back to the server once the reader took it, so no more than a
+    // stream window is ever queued.
+    struct body_channel {
+        queue<temporary_buffer<char>> chunks {std::numeric_limits<size_t>::max()};
+        // bytes pushed and not taken yet
+        size_t queued {0};
+        // set once the reader went away, later chunks are given back right away
+        bool abandoned {false};
+        connection_ref conn;
+        int32_t stream_id;
+
+        body_channel(connection_ref conn_, int32_t stream_id_)
+            : conn(std::move(conn_)), stream_id(stream_id_) {}
+        void push(temporary_buffer<char> chunk);
+        // the reader took len bytes
+        void consumed(size_t len);
+        // the stream or its connection failed, what is queued is dropped
+        void abort(std::exception_ptr ex);
+        // the reader went away
+        void abandon();
+        // flush unless called from the receive loop, which sends once done with its input
+        void give_back(size_t len, bool flush) noexcept;
+    };
+    class body_source;
+    struct pending_stream {
+        promise<client_response> ready;
+        client_response rep;
+        lw_shared_ptr<body_channel> body;
+        bool headers_done {false};
+        bool body_done {false};
+    };
+    struct connection {
+        std::unique_ptr<http2_connection<session_t::client>> conn;
+        std::unordered_map<int32_t, pending_stream> streams;
+        // what the bodies reach the connection through, cleared once it is gone
+        connection_ref ref;
+    };
+
+    future<connection*> pick();
+    future<connection*> open();
+    future<client_response> submit(connection &c, lw_shared_ptr<request> req);
+    void observe(connection &c);
+    void on_header(connection &c, int32_t stream_id, const uint8_t *name, size_t namelen,
+                   const uint8_t *value, size_t valuelen);
+    void on_headers(connection &c, int32_t stream_id);
+    void on_data(connection &c, int32_t stream_id, temporary_buffer<char> chunk, bool end_of_stream);
+    void on_close(connection &c, int32_t stream_id, uint32_t error_code);
+    void on_connection_closed(connection &c);
+    void wake_one();
+    void wake_all();
+
+    upstream_config _cfg;
+    routes _routes;
+    std::list<connection> _connections;
+    unsigned _connecting {0};
+    std::deque<promise<>> _waiters;
+    bool _closing {false};
+    connection_stats _closed_stats;
+    gate _gate;
+};
+
+}
+}
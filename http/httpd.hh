@@ -252,10 +252,16 @@ private:
 public:
     routes _routes;
     seastar::httpd2::routes _routes_http2;
+    seastar::httpd2::admission_controller _admission_http2;
+    seastar::httpd2::flood_stats _flood_stats_http2;
+    seastar::httpd2::session_memory_metrics _session_memory_metrics_http2;
 
     using connection = seastar::httpd::connection;
-    explicit http_server(const sstring& name) : _stats(*this, name) {
+    explicit http_server(const sstring& name) : _stats(*this, name), _admission_http2(name), _flood_stats_http2(name),
+            _session_memory_metrics_http2(name) {
         _date_format_timer.arm_periodic(1s);
+        _routes_http2._admission = &_admission_http2;
+        _routes_http2._flood_stats = &_flood_stats_http2;
     }
     future<> listen(ipv4_addr addr, bool with_tls) {
         if (with_tls) {
@@ -25,6 +25,9 @@
 #include "http/http2_connection.hh"
 #include "core/sstring.hh"
 #include <cassert>
+#include <cstring>
+#include <string>
+#include <vector>
 
 namespace seastar {
 
@@ -47,13 +50,35 @@ public:
             [](auto, auto, auto, const uint8_t *data, size_t len, void *ud) {
                 auto env = static_cast<http2_test_env*>(ud);
                 env->response = sstring(reinterpret_cast<const char*>(data), len);
-                std::cout << env->response << "\n";
+                if (!env->quiet) {
+                    std::cout << env->response << "\n";
+                }
+                return 0;
+            });
+        nghttp2_session_callbacks_set_on_header_callback(callbacks,
+            [](auto, auto, const uint8_t *name, size_t namelen, const uint8_t *value, size_t valuelen, auto, void *ud) {
+                if (namelen == 7 && !memcmp(name, ":status", namelen)) {
+                    auto env = static_cast<http2_test_env*>(ud);
+                    env->statuses.push_back(std::stoul(std::string(reinterpret_cast<const char*>(value), valuelen)));
+                }
+                return 0;
+            });
+        nghttp2_session_callbacks_set_on_stream_close_callback(callbacks,
+            [](auto, auto, uint32_t error_code, void *ud) {
+                auto env = static_cast<http2_test_env*>(ud);
+                ++(error_code == NGHTTP2_NO_ERROR? env->closed_streams : env->reset_streams);
+                if (error_code != NGHTTP2_NO_ERROR) {
+                    env->reset_codes.push_back(error_code);
+                }
                 return 0;
             });
         rv = nghttp2_session_client_new(&session, callbacks, this);
         nghttp2_session_callbacks_del(callbacks);
         assert (rv == 0 && session);
     }
+    ~http2_test_env() {
+        nghttp2_session_del(session);
+    }
 
     sstring prepare_http2_request(h2::request &req) {
         auto rv = nghttp2_submit_settings(session, NGHTTP2_FLAG_NONE, nullptr, 0);
@@ -80,6 +105,62 @@ public:
         return raw_frames;
     }
 
+    // The connection preface followed by count requests, each on a stream of
+    // its own. Nothing is dumped, the frames are meant to be replayed quietly.
+    // The replay never acknowledges anything, so the flow control windows are
+    // opened all the way up front.
+    sstring prepare_http2_requests(h2::request &req, unsigned count) {
+        nghttp2_settings_entry entry{NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, NGHTTP2_MAX_WINDOW_SIZE};
+        auto rv = nghttp2_submit_settings(session, NGHTTP2_FLAG_NONE, &entry, 1);
+        assert(rv == 0);
+        rv = nghttp2_session_set_local_window_size(session, NGHTTP2_FLAG_NONE, 0, NGHTTP2_MAX_WINDOW_SIZE);
+        assert(rv == 0);
+        req.done();
+        for (auto i = 0u; i < count; i++) {
+            auto stream_id = nghttp2_submit_request(session, nullptr, req.data(), req.size(), nullptr, nullptr);
+            assert(stream_id >= 0);
+        }
+        return pending_frames();
+    }
+
+    // The connection preface followed by count streams, each reset by the
+    // client right after its HEADERS went out.
+    sstring prepare_rapid_resets(h2::request &req, unsigned count) {
+        auto rv = nghttp2_submit_settings(session, NGHTTP2_FLAG_NONE, nullptr, 0);
+        assert(rv == 0);
+        req.done();
+        auto raw_frames = pending_frames();
+        for (auto i = 0u; i < count; i++) {
+            auto stream_id = nghttp2_submit_request(session, nullptr, req.data(), req.size(), nullptr, nullptr);
+            assert(stream_id >= 0);
+            raw_frames += pending_frames();
+            rv = nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream_id, NGHTTP2_CANCEL);
+            assert(rv == 0);
+            raw_frames += pending_frames();
+        }
+        return raw_frames;
+    }
+
+    // whatever the session queued meanwhile, e.g. SETTINGS ACKs and WINDOW_UPDATEs
+    sstring pending_frames() {
+        sstring raw_frames;
+        for (;;) {
+            const uint8_t *data = nullptr;
+            auto bytes = nghttp2_session_mem_send(session, &data);
+            assert(bytes >= 0);
+            if (bytes == 0) {
+                break;
+            }
+            raw_frames += sstring(reinterpret_cast<const char*>(data), static_cast<size_t>(bytes));
+        }
+        return raw_frames;
+    }
+
+    // as the server's last SETTINGS frame left it
+    uint32_t remote_setting(nghttp2_settings_id id) {
+        return nghttp2_session_get_remote_settings(session, id);
+    }
+
     bool read_http2(const temporary_buffer<char>& b) {
         auto data = reinterpret_cast<const uint8_t *>(b.get());
         auto rv = nghttp2_session_mem_recv(session, data, b.size());
@@ -176,6 +257,14 @@ public:
 
     promise<> done;
     sstring response;
+    // :status of every response header block received, in order
+    std::vector<unsigned> statuses;
+    unsigned closed_streams {0};
+    unsigned reset_streams {0};
+    // error code of every stream counted in reset_streams
+    std::vector<uint32_t> reset_codes;
+    // don't echo response bodies
+    bool quiet {false};
     sstring expected_rep_body;
     bool frames_fulfilled {false};
 private:
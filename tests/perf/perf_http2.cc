@@ -0,0 +1,112 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2018 ScyllaDB Ltd.
+ */
+
+#include "tests/perf/perf_tests.hh"
+#include "tests/loopback_socket.hh"
+#include "http/httpd.hh"
+#include "http/http2_client.hh"
+#include "core/memory.hh"
+
+using namespace seastar;
+namespace h2 = seastar::httpd2;
+
+// The whole stack end to end: http_server accepting HTTP/2 connections and
+// http_client bursting requests at it, over in-memory loopback sockets so
+// the numbers don't depend on the network. One iteration is one connection
+// serving a burst of requests_per_iteration GETs. Ns and allocations per
+// request are printed once the test is done, both counted over the iterations
+// alone, so they include each iteration setting up and tearing down its
+// connection.
+struct http2_loopback {
+    static constexpr uint16_t requests_per_iteration = 100;
+    using handler_result = std::tuple<lw_shared_ptr<h2::request>, std::unique_ptr<h2::response>>;
+
+    loopback_connection_factory lcf;
+    loopback_socket_impl lsi{lcf};
+    httpd::http_server server{"perf_http2"};
+    h2::http_client client;
+    sstring body_64k = sstring(64 << 10, 'x');
+    sstring path;
+    uint64_t responses {0};
+    uint64_t mallocs {0};
+    steady_clock_type::duration elapsed {0};
+
+    http2_loopback() {
+        auto &listeners = httpd::http_server_tester::listeners(server);
+        // the legacy listener is never accepted from, the HTTP/2 one is the second
+        listeners.emplace_back(lcf.get_server_socket());
+        listeners.emplace_back(lcf.get_server_socket());
+        server._routes_http2.add(h2::method::GET, "/small", [] (auto req, auto rep) {
+            rep->_body = "hello!";
+            return make_ready_future<handler_result>(std::make_tuple(std::move(req), std::move(rep)));
+        }).add(h2::method::GET, "/64k", [this] (auto req, auto rep) {
+            rep->_body = body_64k;
+            return make_ready_future<handler_result>(std::make_tuple(std::move(req), std::move(rep)));
+        }).add(h2::method::GET, "/cached", [] (auto req, auto rep) {
+            rep->add_header("cache-control", "max-age=3600");
+            rep->_body = "hello!";
+            return make_ready_future<handler_result>(std::make_tuple(std::move(req), std::move(rep)));
+        }).cache("/cached");
+        client._routes.add_on_client([this] (int32_t, temporary_buffer<char>, bool end_of_stream) {
+            responses += end_of_stream;
+        });
+        server.do_accepts(1);
+    }
+
+    ~http2_loopback() {
+        if (responses) {
+            auto ns = std::chrono::duration<double, std::nano>(elapsed).count() / responses;
+            fmt::print("{}: {:.0f} ns/req, {:.0f} req/s, {:.1f} allocs/req, connection setup included\n",
+                       path, ns, 1e9 / ns, static_cast<double>(mallocs) / responses);
+        }
+        // perf tests run in a seastar thread
+        server.stop().get();
+    }
+
+    future<> get(const sstring &p) {
+        path = p;
+        auto mallocs_before = memory::stats().mallocs();
+        auto start = steady_clock_type::now();
+        return client.connect(1, [this] {
+            return lsi.connect(socket_address(ipv4_addr()), socket_address(ipv4_addr()));
+        }).then([this] {
+            h2::request req{{":method", "GET"}, {":path", path}, {":scheme", "http"}, {":authority", "localhost"}};
+            return do_with(std::move(req), [this] (h2::request &req) {
+                return client.run(&req, requests_per_iteration);
+            });
+        }).then([this, mallocs_before, start] {
+            elapsed += steady_clock_type::now() - start;
+            mallocs += memory::stats().mallocs() - mallocs_before;
+        });
+    }
+};
+
+PERF_TEST_F(http2_loopback, small_body) {
+    return get("/small");
+}
+
+PERF_TEST_F(http2_loopback, body_64KiB) {
+    return get("/64k");
+}
+
+PERF_TEST_F(http2_loopback, cached_response) {
+    return get("/cached");
+}
@@ -0,0 +1,220 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2018 ScyllaDB Ltd.
+ */
+
+#include "tests/perf/perf_tests.hh"
+#include "tests/loopback_socket.hh"
+#include "tests/http2_test_env.hh"
+#include "http/http2_connection.hh"
+#include "core/memory.hh"
+#include "core/thread.hh"
+#include <deque>
+
+using namespace seastar;
+namespace h2 = seastar::httpd2;
+
+// Connection setup cost, one step at a time, so that the saving of every
+// cached or recycled piece shows up as the difference between two lines.
+struct http2_connection_setup {
+    loopback_connection_factory lcf;
+    server_socket listener = lcf.get_server_socket();
+    loopback_socket_impl lsi{lcf};
+    h2::routes routes;
+    sstring date = "01 Jan 2018 00:00:00 GMT";
+
+    http2_connection_setup() {
+        routes._date = &date;
+    }
+
+    future<connected_socket> accept_one() {
+        return lsi.connect(socket_address(ipv4_addr()), socket_address(ipv4_addr())).then([this] (connected_socket client) {
+            return listener.accept().then([client = std::move(client)] (connected_socket fd, socket_address) mutable {
+                // the client side is not needed, closing it is part of the measured churn
+                return std::move(fd);
+            });
+        });
+    }
+};
+
+// what every connection used to pay before the callback tables were cached
+PERF_TEST_F(http2_connection_setup, callbacks_table_built) {
+    nghttp2_session_callbacks *cbs;
+    nghttp2_session_callbacks_new(&cbs);
+    h2::http2_connection_tester::set_callbacks<h2::session_t::server>(cbs);
+    perf_tests::do_not_optimize(cbs);
+    nghttp2_session_callbacks_del(cbs);
+}
+
+// and what it pays now
+PERF_TEST_F(http2_connection_setup, callbacks_table_cached) {
+    perf_tests::do_not_optimize(h2::http2_connection_tester::callbacks<h2::session_t::server>());
+}
+
+PERF_TEST_F(http2_connection_setup, nghttp2_session) {
+    nghttp2_session *session;
+    nghttp2_session_server_new(&session, h2::http2_connection_tester::callbacks<h2::session_t::server>(), nullptr);
+    nghttp2_settings_entry entry{NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, 100u};
+    nghttp2_submit_settings(session, NGHTTP2_FLAG_NONE, &entry, 1);
+    perf_tests::do_not_optimize(session);
+    nghttp2_session_del(session);
+}
+
+PERF_TEST_F(http2_connection_setup, loopback_accept) {
+    return accept_one().then([] (connected_socket fd) {
+        perf_tests::do_not_optimize(fd);
+    });
+}
+
+PERF_TEST_F(http2_connection_setup, server_connection) {
+    return accept_one().then([this] (connected_socket fd) {
+        auto conn = new h2::http2_connection<>(routes, std::move(fd));
+        perf_tests::do_not_optimize(conn);
+        delete conn;
+    });
+}
+
+// Bytes per idle connection of the fresh fixture, for the compacted one to
+// report its saving against.
+static thread_local size_t fresh_idle_bytes = 0;
+
+// Idle connections are kept alive across iterations (the oldest ones are
+// recycled once max_idle is reached) and the fixture reports the shard memory
+// each of them holds, which is what bounds C1M-style fan-in per node. Every
+// connection first serves a few requests with a client that acknowledges the
+// server's SETTINGS, so the HPACK tables and the stream map are populated as
+// on a real connection that went quiet. The compacted fixture then compacts
+// it and waits for the client's ACK to reach the server.
+template<bool compact>
+struct http2_idle_connections : http2_connection_setup {
+    using handler_result = std::tuple<lw_shared_ptr<h2::request>, std::unique_ptr<h2::response>>;
+    static constexpr size_t max_idle = 10000;
+    static constexpr unsigned requests_per_connection = 4;
+
+    struct idle_connection {
+        std::unique_ptr<h2::http2_connection<>> conn;
+        future<> served = make_ready_future<>();
+        connected_socket client;
+        input_stream<char> in;
+        output_stream<char> out;
+
+        future<> close() {
+            client.shutdown_output();
+            return std::move(served).finally([this] {
+                return out.close();
+            });
+        }
+    };
+
+    std::deque<std::unique_ptr<idle_connection>> conns;
+    size_t baseline = allocated();
+
+    static size_t allocated() {
+        auto stats = memory::stats();
+        return stats.total_memory() - stats.free_memory();
+    }
+
+    http2_idle_connections() {
+        // compaction is triggered by the fixture, never by the idle timer
+        routes._idle_compact_after = lowres_clock::duration(0);
+        routes.add(h2::method::GET, "/idle", [] (auto req, auto rep) {
+            rep->add_header("cache-control", "no-cache");
+            rep->_body = "hello!";
+            return make_ready_future<handler_result>(std::make_tuple(std::move(req), std::move(rep)));
+        });
+    }
+
+    ~http2_idle_connections() {
+        if (!conns.empty()) {
+            auto nghttp2_bytes = 0ul;
+            for (auto &idle : conns) {
+                nghttp2_bytes += idle->conn->session_memory_usage();
+            }
+            auto bytes = (allocated() - baseline) / conns.size();
+            fmt::print("{} idle connections: {} bytes per connection, {} of them in nghttp2\n",
+                       compact? "compacted" : "fresh", bytes, nghttp2_bytes / conns.size());
+            if (!compact) {
+                fresh_idle_bytes = bytes;
+            } else if (fresh_idle_bytes) {
+                fmt::print("compaction saves {} bytes per idle connection\n", int64_t(fresh_idle_bytes) - int64_t(bytes));
+            }
+        }
+        // perf tests run in a seastar thread
+        for (auto &idle : conns) {
+            idle->close().get();
+        }
+    }
+
+    future<> keep_one() {
+        return seastar::async([this] {
+            if (conns.size() == max_idle) {
+                conns.front()->close().get();
+                conns.pop_front();
+            }
+            auto idle = std::make_unique<idle_connection>();
+            idle->client = lsi.connect(socket_address(ipv4_addr()), socket_address(ipv4_addr())).get0();
+            idle->conn = std::make_unique<h2::http2_connection<>>(routes, listener.accept().get0());
+            idle->served = idle->conn->process();
+            idle->in = idle->client.input();
+            idle->out = idle->client.output();
+            auto exchange = [&idle] (http2_test_env &env) {
+                idle->out.write(env.pending_frames()).get();
+                idle->out.flush().get();
+            };
+            auto receive = [&idle] (http2_test_env &env) {
+                auto buf = idle->in.read().get0();
+                assert(!buf.empty());
+                env.read_http2(buf);
+            };
+
+            http2_test_env env;
+            env.quiet = true;
+            h2::request req({{":method", "GET"}, {":path", "/idle"}, {":scheme", "http"}, {":authority", "localhost"},
+                             {"accept", "*/*"}, {"user-agent", "nghttp2/" NGHTTP2_VERSION},
+                             {"cookie", sstring(64, 'c')}});
+            idle->out.write(env.prepare_http2_requests(req, requests_per_connection)).get();
+            idle->out.flush().get();
+            while (env.closed_streams < requests_per_connection) {
+                receive(env);
+            }
+            // the ACK of the server's SETTINGS
+            exchange(env);
+            if (compact) {
+                h2::http2_connection_tester::compact(*idle->conn).get();
+                // SETTINGS_HEADER_TABLE_SIZE=0, acknowledged, after which the
+                // server restores the table size in a SETTINGS of its own
+                receive(env);
+                exchange(env);
+                receive(env);
+            }
+            conns.emplace_back(std::move(idle));
+        });
+    }
+};
+
+using http2_fresh_idle_connections = http2_idle_connections<false>;
+using http2_compacted_idle_connections = http2_idle_connections<true>;
+
+PERF_TEST_F(http2_fresh_idle_connections, idle_connection) {
+    return keep_one();
+}
+
+PERF_TEST_F(http2_compacted_idle_connections, idle_connection) {
+    return keep_one();
+}
@@ -0,0 +1,413 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2018 ScyllaDB Ltd.
+ */
+
+#include "tests/perf/perf_tests.hh"
+#include "tests/loopback_socket.hh"
+#include "http/http2_connection.hh"
+#include <algorithm>
+#include <array>
+#include <vector>
+
+using namespace seastar;
+namespace h2 = seastar::httpd2;
+
+static connected_socket make_loopback_socket() {
+    auto b1 = make_lw_shared<loopback_buffer>();
+    auto b2 = make_lw_shared<loopback_buffer>();
+    return connected_socket(std::make_unique<loopback_connected_socket_impl>(b1, b2));
+}
+
+template<size_t size>
+static const uint8_t *bytes(const char (&str)[size]) {
+    return reinterpret_cast<const uint8_t*>(str);
+}
+
+// One iteration is one header delivered by nghttp2, so the result is ns per header.
+struct http2_header_decode {
+    h2::routes routes;
+    h2::http2_connection<> conn{routes, make_loopback_socket()};
+    nghttp2_frame frame;
+
+    http2_header_decode() {
+        frame.hd.type = NGHTTP2_HEADERS;
+        frame.hd.stream_id = 1;
+        frame.hd.flags = NGHTTP2_FLAG_END_HEADERS;
+        frame.headers.cat = NGHTTP2_HCAT_REQUEST;
+        h2::http2_connection_tester::on_begin_headers(conn, &frame);
+    }
+};
+
+PERF_TEST_F(http2_header_decode, pseudo_header) {
+    auto rv = h2::http2_connection_tester::on_header(conn, &frame, bytes(":path"), sizeof(":path") - 1,
+                                                     bytes("/index.html"), sizeof("/index.html") - 1);
+    perf_tests::do_not_optimize(rv);
+}
+
+PERF_TEST_F(http2_header_decode, regular_header) {
+    auto rv = h2::http2_connection_tester::on_header(conn, &frame, bytes("user-agent"), sizeof("user-agent") - 1,
+                                                     bytes("nghttp2/" NGHTTP2_VERSION), sizeof("nghttp2/" NGHTTP2_VERSION) - 1);
+    perf_tests::do_not_optimize(rv);
+}
+
+// request and response headers as sent by a browser-like client and a handler
+template<unsigned count>
+static std::vector<std::pair<sstring, sstring>> make_headers() {
+    std::vector<std::pair<sstring, sstring>> headers;
+    for (auto i = 0u; i < count; i++) {
+        headers.emplace_back(format("x-header-{}", i), format("value of header {}", i));
+    }
+    return headers;
+}
+
+// One iteration is a fresh request fed count headers, as update_request() does,
+// four pseudo-headers included.
+template<unsigned count>
+struct http2_request_add_header {
+    std::vector<std::pair<sstring, sstring>> headers = make_headers<count - 4>();
+
+    void run() {
+        h2::request req;
+        req.add_header(bytes(":method"), sizeof(":method") - 1, bytes("GET"), sizeof("GET") - 1);
+        req.add_header(bytes(":path"), sizeof(":path") - 1, bytes("/index.html"), sizeof("/index.html") - 1);
+        req.add_header(bytes(":scheme"), sizeof(":scheme") - 1, bytes("https"), sizeof("https") - 1);
+        req.add_header(bytes(":authority"), sizeof(":authority") - 1, bytes("localhost"), sizeof("localhost") - 1);
+        for (auto &[name, value] : headers) {
+            req.add_header(reinterpret_cast<const uint8_t*>(name.data()), name.size(),
+                           reinterpret_cast<const uint8_t*>(value.data()), value.size());
+        }
+        perf_tests::do_not_optimize(req);
+    }
+};
+
+using http2_request_add_header_8 = http2_request_add_header<8>;
+using http2_request_add_header_32 = http2_request_add_header<32>;
+
+PERF_TEST_F(http2_request_add_header_8, add_header) {
+    run();
+}
+
+PERF_TEST_F(http2_request_add_header_32, add_header) {
+    run();
+}
+
+// One iteration rebuilds the nghttp2_nv array of count headers.
+template<unsigned count>
+struct http2_headers_done {
+    h2::response rep;
+
+    http2_headers_done() {
+        for (auto &[name, value] : make_headers<count>()) {
+            rep.add_header(name, value);
+        }
+    }
+
+    void run() {
+        rep.clear();
+        rep.done();
+        perf_tests::do_not_optimize(rep.data());
+    }
+};
+
+using http2_headers_done_4 = http2_headers_done<4>;
+using http2_headers_done_16 = http2_headers_done<16>;
+using http2_headers_done_64 = http2_headers_done<64>;
+
+PERF_TEST_F(http2_headers_done_4, done) {
+    run();
+}
+
+PERF_TEST_F(http2_headers_done_16, done) {
+    run();
+}
+
+PERF_TEST_F(http2_headers_done_64, done) {
+    run();
+}
+
+// One iteration commits a handler's response carrying count headers: status,
+// date and content-length added, body provider armed, nghttp2_nv array built.
+template<unsigned count>
+struct http2_commit_response {
+    h2::routes routes;
+    sstring date = "01 Jan 2018 00:00:00 GMT";
+    std::vector<std::pair<sstring, sstring>> headers = make_headers<count>();
+    h2::http2_stream stream{1, routes};
+
+    http2_commit_response() {
+        routes._date = &date;
+    }
+
+    void run() {
+        auto rep = std::make_unique<h2::response>();
+        for (auto &[name, value] : headers) {
+            rep->add_header(name, value);
+        }
+        rep->_body = "hello!";
+        stream.set_response(std::move(rep));
+        stream.commit_response();
+        perf_tests::do_not_optimize(stream.get_response().data());
+    }
+};
+
+using http2_commit_response_0 = http2_commit_response<0>;
+using http2_commit_response_16 = http2_commit_response<16>;
+
+PERF_TEST_F(http2_commit_response_0, commit_response) {
+    run();
+}
+
+PERF_TEST_F(http2_commit_response_16, commit_response) {
+    run();
+}
+
+// One iteration copies a whole body of size bytes into DATA frame payloads
+// through the data provider, 16 KiB at a time as nghttp2 asks for them.
+template<size_t size>
+struct http2_flush_body {
+    h2::response rep;
+    std::array<uint8_t, 16384> frame;
+
+    http2_flush_body() {
+        rep._body = sstring(size, 'x');
+    }
+
+    void run() {
+        rep.flush_body();
+        auto provider = rep.get_provider();
+        auto source = const_cast<nghttp2_data_source*>(&provider->source);
+        uint32_t flags = 0;
+        while (!(flags & NGHTTP2_DATA_FLAG_EOF)) {
+            provider->read_callback(nullptr, 1, frame.data(), frame.size(), &flags, source, nullptr);
+        }
+        perf_tests::do_not_optimize(frame);
+    }
+};
+
+using http2_flush_body_1KiB = http2_flush_body<1 << 10>;
+using http2_flush_body_64KiB = http2_flush_body<64 << 10>;
+using http2_flush_body_1MiB = http2_flush_body<1 << 20>;
+
+PERF_TEST_F(http2_flush_body_1KiB, flush_body) {
+    run();
+}
+
+PERF_TEST_F(http2_flush_body_64KiB, flush_body) {
+    run();
+}
+
+PERF_TEST_F(http2_flush_body_1MiB, flush_body) {
+    run();
+}
+
+// One iteration is one handler lookup among count registered paths.
+template<unsigned count>
+struct http2_routes_handle {
+    h2::routes routes;
+    sstring hit = format("/api/v1/resource/{}", count / 2);
+    sstring miss = "/api/v1/missing";
+
+    http2_routes_handle() {
+        for (auto i = 0u; i < count; i++) {
+            routes.add(h2::method::GET, format("/api/v1/resource/{}", i), [] (auto req, auto rep) {
+                return make_ready_future<std::tuple<lw_shared_ptr<h2::request>, std::unique_ptr<h2::response>>>(
+                        std::make_tuple(std::move(req), std::move(rep)));
+            });
+        }
+    }
+};
+
+using http2_routes_handle_10 = http2_routes_handle<10>;
+using http2_routes_handle_1000 = http2_routes_handle<1000>;
+
+PERF_TEST_F(http2_routes_handle_10, hit) {
+    perf_tests::do_not_optimize(routes.handle(hit));
+}
+
+PERF_TEST_F(http2_routes_handle_10, miss) {
+    perf_tests::do_not_optimize(routes.handle(miss));
+}
+
+PERF_TEST_F(http2_routes_handle_1000, hit) {
+    perf_tests::do_not_optimize(routes.handle(hit));
+}
+
+PERF_TEST_F(http2_routes_handle_1000, miss) {
+    perf_tests::do_not_optimize(routes.handle(miss));
+}
+
+// One iteration is one stream lookup among count open streams, either the
+// stream of the previous frame (cached) or another one.
+template<unsigned count>
+struct http2_find_stream {
+    h2::routes routes;
+    h2::http2_connection<> conn{routes, make_loopback_socket()};
+    int32_t next {1};
+
+    http2_find_stream() {
+        for (auto i = 0u; i < count; i++) {
+            conn.create_stream(2 * i + 1, make_lw_shared<h2::request>());
+        }
+    }
+
+    int32_t other_stream() {
+        next = (next + 2) % (2 * count);
+        return next;
+    }
+};
+
+using http2_find_stream_1 = http2_find_stream<1>;
+using http2_find_stream_100 = http2_find_stream<100>;
+
+PERF_TEST_F(http2_find_stream_1, same_stream) {
+    perf_tests::do_not_optimize(h2::http2_connection_tester::find_stream(conn, 1));
+}
+
+PERF_TEST_F(http2_find_stream_100, same_stream) {
+    perf_tests::do_not_optimize(h2::http2_connection_tester::find_stream(conn, 1));
+}
+
+PERF_TEST_F(http2_find_stream_100, other_stream) {
+    perf_tests::do_not_optimize(h2::http2_connection_tester::find_stream(conn, other_stream()));
+}
+
+// Bare nghttp2 client and server sessions wired back to back in memory, as in
+// tests/http2_test_env.hh. One iteration is a GET with count extra headers
+// going through mem_send/mem_recv and a response with a body of size bytes
+// coming back, i.e. the library's share of every request.
+template<unsigned count, size_t size>
+struct http2_nghttp2_round_trip {
+    nghttp2_session *client {nullptr};
+    nghttp2_session *server {nullptr};
+    std::vector<std::pair<sstring, sstring>> headers = make_headers<count>();
+    std::vector<nghttp2_nv> request_nva;
+    std::vector<nghttp2_nv> response_nva;
+    sstring body = sstring(size, 'x');
+    size_t received {0};
+
+    static nghttp2_nv nv(const sstring &name, const sstring &value) {
+        return {const_cast<uint8_t*>(reinterpret_cast<const uint8_t*>(name.data())),
+                const_cast<uint8_t*>(reinterpret_cast<const uint8_t*>(value.data())),
+                name.size(), value.size(), NGHTTP2_NV_FLAG_NONE};
+    }
+
+    http2_nghttp2_round_trip() {
+        static const std::vector<std::pair<sstring, sstring>> pseudo = {{":method", "GET"}, {":path", "/index.html"},
+                                                                        {":scheme", "http"}, {":authority", "localhost"}};
+        static const std::pair<sstring, sstring> status = {":status", "200"};
+        for (auto &[name, value] : pseudo) {
+            request_nva.push_back(nv(name, value));
+        }
+        for (auto &[name, value] : headers) {
+            request_nva.push_back(nv(name, value));
+        }
+        response_nva.push_back(nv(status.first, status.second));
+
+        nghttp2_session_callbacks *callbacks;
+        nghttp2_session_callbacks_new(&callbacks);
+        nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks,
+            [](nghttp2_session*, uint8_t, int32_t, const uint8_t*, size_t len, void *ud) {
+                static_cast<http2_nghttp2_round_trip*>(ud)->received += len;
+                return 0;
+            });
+        nghttp2_session_client_new(&client, callbacks, this);
+        nghttp2_session_callbacks_del(callbacks);
+
+        nghttp2_session_callbacks_new(&callbacks);
+        nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks,
+            [](nghttp2_session *session, const nghttp2_frame *frame, void *ud) {
+                if (frame->hd.type == NGHTTP2_HEADERS && (frame->hd.flags & NGHTTP2_FLAG_END_STREAM)) {
+                    static_cast<http2_nghttp2_round_trip*>(ud)->respond(session, frame->hd.stream_id);
+                }
+                return 0;
+            });
+        nghttp2_session_server_new(&server, callbacks, this);
+        nghttp2_session_callbacks_del(callbacks);
+
+        nghttp2_submit_settings(client, NGHTTP2_FLAG_NONE, nullptr, 0);
+        nghttp2_submit_settings(server, NGHTTP2_FLAG_NONE, nullptr, 0);
+        pump();
+    }
+    ~http2_nghttp2_round_trip() {
+        nghttp2_session_del(client);
+        nghttp2_session_del(server);
+    }
+
+    void respond(nghttp2_session *session, int32_t stream_id) {
+        nghttp2_data_provider prd;
+        prd.source.ptr = this;
+        prd.read_callback = [](nghttp2_session*, int32_t, uint8_t *buf, size_t length, uint32_t *flags,
+                               nghttp2_data_source *source, void*) -> ssize_t {
+            auto self = static_cast<http2_nghttp2_round_trip*>(source->ptr);
+            auto sent = self->body_sent;
+            auto chunk = std::min(length, self->body.size() - sent);
+            std::copy_n(self->body.data() + sent, chunk, buf);
+            self->body_sent += chunk;
+            if (self->body_sent == self->body.size()) {
+                *flags |= NGHTTP2_DATA_FLAG_EOF;
+            }
+            return chunk;
+        };
+        body_sent = 0;
+        nghttp2_submit_response(session, stream_id, response_nva.data(), response_nva.size(), &prd);
+    }
+
+    // moves frames between the sessions until both are quiet
+    void pump() {
+        for (;;) {
+            const uint8_t *data;
+            auto to_server = nghttp2_session_mem_send(client, &data);
+            if (to_server > 0) {
+                nghttp2_session_mem_recv(server, data, to_server);
+            }
+            auto to_client = nghttp2_session_mem_send(server, &data);
+            if (to_client > 0) {
+                nghttp2_session_mem_recv(client, data, to_client);
+            }
+            if (to_server <= 0 && to_client <= 0) {
+                return;
+            }
+        }
+    }
+
+    void run() {
+        nghttp2_submit_request(client, nullptr, request_nva.data(), request_nva.size(), nullptr, nullptr);
+        pump();
+        perf_tests::do_not_optimize(received);
+    }
+
+    size_t body_sent {0};
+};
+
+using http2_nghttp2_round_trip_small = http2_nghttp2_round_trip<4, 16>;
+using http2_nghttp2_round_trip_headers = http2_nghttp2_round_trip<32, 16>;
+using http2_nghttp2_round_trip_body = http2_nghttp2_round_trip<4, 64 << 10>;
+
+PERF_TEST_F(http2_nghttp2_round_trip_small, mem_send_recv) {
+    run();
+}
+
+PERF_TEST_F(http2_nghttp2_round_trip_headers, mem_send_recv) {
+    run();
+}
+
+PERF_TEST_F(http2_nghttp2_round_trip_body, mem_send_recv) {
+    run();
+}